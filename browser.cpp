@@ -17,8 +17,11 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
-#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
@@ -29,189 +32,629 @@
 // Testing Purposes
 #include <iostream>
 
-#define COOKIE_PATH "./browser.cookie"
-
-static bool browser_on = true;  // Determines if the browser is on/off.
-static int server_socket_fd;    // The socket file descriptor of the server that is currently being connected.
-static int session_id;          // The session ID of the session on the server that is currently being accessed.
+// Session Lists
+#include <vector>
+#include <string>
+#include <deque>
+#include <algorithm>
 
-// Reads the user input from stdin.
+#define COOKIE_PATH "./browser.cookie"
+#define TLS_SESSION_PATH "./browser.tls_session"   // The resumable TLS session, kept between runs.
+#define KEEPALIVE_INTERVAL_MS 10000     // Silence after which the browser pings the server.
+#define KEEPALIVE_TIMEOUT_MS 30000      // Silence after which the server is considered dead.
+#define RECONNECT_MIN_MS 250            // The first reconnection delay.
+#define RECONNECT_MAX_MS 8000           // The longest reconnection delay.
+#define MAX_QUEUED_INPUT 256            // Lines kept while the browser is not connected.
+
+// The states of the connection to the server.
+typedef enum connection_state_enum {
+    DISCONNECTED,   // Waiting for the reconnection timer.
+    CONNECTING,     // The non-blocking connect() is in progress.
+    REGISTERING,    // The session IDs were sent; waiting for the server's answer.
+    CONNECTED       // Commands and broadcasts flow.
+} connection_state_t;
+
+static bool browser_on = true;                  // Determines if the browser is on/off.
+static bool monitor_only = false;               // Determines if stdin is ignored.
+static bool multiplexed = false;                // Determines if one connection carries many sessions.
+static bool tls_enabled = false;                // Determines if the connection to the server uses TLS.
+static std::vector<int> session_ids;            // The IDs of the sessions being accessed; the first one is the default.
+static int server_socket_fd = -1;               // The socket file descriptor of the server that is currently being connected.
+static struct sockaddr_in server_addr;          // The address of the server.
+static connection_state_t state = DISCONNECTED; // The state of the connection to the server.
+static outbound_t server_outbound;              // Frames waiting to be written to the server.
+static frame_decoder_t server_decoder;          // Bytes from the server not yet split into frames.
+static std::deque<std::string> queued_input;    // Lines typed while the browser was not connected.
+static std::string input_buffer;                // Bytes from stdin not yet ending in a newline.
+static long long reconnect_at = 0;              // When the next connection attempt starts.
+static long long reconnect_delay = RECONNECT_MIN_MS;    // The current reconnection backoff.
+static long long last_received_at = 0;          // When the server was last heard from.
+static long long last_ping_at = 0;              // When the last keepalive ping was sent.
+
+// Returns the time of a monotonic clock in milliseconds.
+long long now_ms();
+
+// Handles one line of user input.
 // If the input is "EXIT" or "exit",
 // changes the browser switch to false.
-void read_user_input(char message[]);
+void handle_user_input(const char line[]);
 
-// Loads the cookie from the disk and gets the session ID
-// if there exists one.
-// Otherwise, assigns the session ID to be -1.
+// Loads the cookie from the disk and gets every session ID
+// stored in it.
+// Otherwise, leaves the session list empty.
 void load_cookie();
 
-// Saves the session ID to the cookie on the disk.
+// Saves the session IDs to the cookie on the disk.
 void save_cookie();
 
-// Interacts with the server to get or confirm
-// the final session ID.
-void register_server();
+// Builds the registration message that asks the server
+// to get or confirm the final session IDs.
+std::string build_registration();
+
+// Reads the server's answer to the registration
+// and switches to the connected state.
+bool handle_registration(const char reply[]);
+
+// Prints a message received from the server,
+// tracking subscriptions if it is tagged with a session.
+void handle_server_message(const char message[]);
+
+// Queues the message to the server and writes as much as the socket takes.
+void send_to_server(const char message[]);
+
+// Starts a non-blocking connection attempt to the server.
+void connect_server();
+
+// Sends the registration once the connection to the server is established.
+void on_connected();
+
+// Closes the connection and schedules a reconnection with backoff.
+void schedule_reconnect(const char reason[]);
 
-// Listens to the server.
-// Keeps receiving and printing the messages from the server.
-void * server_listener();
+// Reads everything the server has sent
+// and handles every complete frame.
+void receive_from_server();
+
+// Reads everything available on stdin
+// and handles every complete line.
+void read_user_input();
+
+// Pings the server after a silence
+// and drops the connection if it stays silent.
+void check_keepalive(long long now);
 
 // Starts the browser.
-// Sets up the connection, start the listener thread,
-// and keeps a loop to read in the user's input and send it out.
+// Runs a single poll loop over stdin, the server socket and the timers
+// until the user exits.
 void start_browser(const char host_ip[], int port);
 
 /**
- * Reads the user input from stdin. If the input is "EXIT" or "exit",
- * changes the browser switch to false.
+ * Returns the time of a monotonic clock in milliseconds.
  *
- * @param message an array to store the user input
+ * @return the current time
  */
-void read_user_input(char message[]) {
-    fgets(message, BUFFER_LEN, stdin);
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    if (message[strlen(message) - 1] == '\n') {
-        message[strlen(message) - 1] = '\0';
+/**
+ * Handles one line of user input. If the input is "EXIT" or "exit",
+ * changes the browser switch to false. Lines typed before the browser is
+ * registered are queued and sent once it is; the user is only told so while
+ * it waits to reconnect, not during an ordinary connection and registration.
+ *
+ * @param line the user input without its newline
+ */
+void handle_user_input(const char line[]) {
+    if ((strcmp(line, "EXIT") == 0) || (strcmp(line, "exit") == 0)) {
+        browser_on = false;
+        if (state == CONNECTED) {
+            send_to_server(line);
+        }
+        return;
     }
 
-    if ((strcmp(message, "EXIT") == 0) || (strcmp(message, "exit") == 0)) {
-        browser_on = false;
+    if (state == CONNECTED) {
+        send_to_server(line);
+        return;
+    }
+
+    if (queued_input.size() == MAX_QUEUED_INPUT) {
+        queued_input.pop_front();
+    }
+    queued_input.push_back(line);
+    if (state == DISCONNECTED) {
+        puts("Not connected; the input will be sent after reconnecting.");
     }
 }
 
 /**
- * Loads the cookie from the disk and gets the session ID if there exists one.
- * Otherwise, assigns the session ID to be -1.
+ * Loads the cookie from the disk and gets every session ID stored in it.
+ * Each entry is a line of the form "session_id:<id>;".
  * The file path of the cookie is stored in COOKIE_PATH.
  */
 void load_cookie() {
 	std::ifstream cookie_file;
-	std::string cookie_key;
+	std::string line;
 
+	session_ids.clear();
 	cookie_file.open(COOKIE_PATH);
 
 	if (!cookie_file.good()) {
-		session_id = -1;
 		return;
 	}
 
-	char c;
-
-	while (!cookie_file.eof()) {
-		c = cookie_file.get();
-		if (c == ':') {
-			break;
+	while (std::getline(cookie_file, line)) {
+		size_t colon = line.find(':');
+		if (colon == std::string::npos || line.compare(0, colon, "session_id") != 0) {
+			continue;
 		}
-		cookie_key += c;
-	}
 
-	if (cookie_key == "session_id") {
-		cookie_file >> session_id;
-		cookie_file.close();
-		return;
+		int id = strtol(line.c_str() + colon + 1, NULL, 10);
+		if (id >= 0 && std::find(session_ids.begin(), session_ids.end(), id) == session_ids.end()) {
+			session_ids.push_back(id);
+		}
 	}
 
-	session_id = -1;
 	cookie_file.close();
 }
 
 /**
- * Saves the session ID to the cookie on the disk.
+ * Saves the session IDs to the cookie on the disk, one entry per line.
  * The file path of the cookie is stored in COOKIE_PATH.
  */
 void save_cookie() {
-    // Adapt if using more than 1 cookie.
 	std::ofstream cookie_file;
 
 	cookie_file.open(COOKIE_PATH);
 
-	cookie_file << "session_id:";
-	cookie_file << std::to_string(session_id);
-	cookie_file << ";\n";
+	for (size_t i = 0; i < session_ids.size(); i++) {
+		cookie_file << "session_id:";
+		cookie_file << std::to_string(session_ids[i]);
+		cookie_file << ";\n";
+	}
 
 	cookie_file.close();
 }
 
 /**
- * Interacts with the server to get or confirm the final session ID.
+ * Builds the registration message that asks the server to get or confirm the final session IDs.
+ * A single-session browser sends its default session ID; a multiplexed browser
+ * sends "MUX" followed by every session ID. -1 asks the server for a new session.
+ *
+ * @return the registration message
  */
-void register_server() {
-    char message[BUFFER_LEN];
-    sprintf(message, "%d", session_id);
-    send_message(server_socket_fd, message);
+std::string build_registration() {
+    if (!multiplexed) {
+        return std::to_string(session_ids.empty() ? -1 : session_ids[0]);
+    }
 
-    receive_message(server_socket_fd, message);
-    session_id = strtol(message, NULL, 10);
+    std::string request = "MUX";
+    for (size_t i = 0; i < session_ids.size(); i++) {
+        request += " " + std::to_string(session_ids[i]);
+    }
+    if (session_ids.empty()) {
+        request += " -1";
+    }
+    return request;
 }
 
 /**
- * Listens to the server; keeps receiving and printing the messages from the server in a while loop
- * if the browser is on.
+ * Reads the server's answer to the registration, saves the final session IDs
+ * to the cookie and sends whatever the user typed while disconnected.
+ *
+ * @param reply the first message received after registering
+ * @return false if the reply is not an answer to the registration; nothing is saved then
  */
-void * server_listener(void * arg) {
-	while (browser_on) {
-    		char message[BUFFER_LEN];
-    		receive_message(server_socket_fd, message);
-    		std::string msg(message);
-                if (msg == "ERROR") {
-                        puts("Invalid input!");
-                } else {
-                        puts(message);
-                }
+bool handle_registration(const char reply[]) {
+    char *end;
+
+    if (!multiplexed) {
+        int session_id = strtol(reply, &end, 10);
+        if (end == reply || *end != '\0') {
+            return false;
+        }
+        if (session_ids.empty()) {
+            session_ids.push_back(session_id);
+        } else {
+            session_ids[0] = session_id;
+        }
+        printf("Running Session #%d:\n", session_id);
+    } else {
+        std::vector<int> assigned;
+        if (strncmp(reply, "MUX", 3) != 0) {
+            return false;
+        }
+        const char *rest = reply + 3;
+        while (true) {
+            long id = strtol(rest, &end, 10);
+            if (end == rest) {
+                break;
+            }
+            assigned.push_back((int) id);
+            rest = end;
+        }
+        if (assigned.empty() || *rest != '\0') {
+            return false;
+        }
+        session_ids = assigned;
+
+        printf("Running %zu sessions:", session_ids.size());
+        for (size_t i = 0; i < session_ids.size(); i++) {
+            printf(" #%d", session_ids[i]);
+        }
+        printf("\n");
+    }
 
-	}
-	return (void *)arg;
+    // Saves the session IDs to the cookie on the disk.
+    save_cookie();
+
+    state = CONNECTED;
+    reconnect_delay = RECONNECT_MIN_MS;
+
+    while (!queued_input.empty() && state == CONNECTED) {
+        send_to_server(queued_input.front().c_str());
+        queued_input.pop_front();
+    }
+    return true;
 }
 
 /**
- * Starts the browser. Sets up the connection, start the listener thread,
- * and keeps a loop to read in the user's input and send it out.
+ * Prints a message received from the server. Keepalive traffic is not printed. Tagged messages ("@<session_id>\n<body>")
+ * are printed under their session, and subscription changes are saved to the cookie.
  *
- * @param host_ip the host ip to connect
- * @param port the host port to connect
+ * @param message the message received
  */
-void start_browser(const char host_ip[], int port) {
-    // Loads the cookies if there exists one on the disk.
-    load_cookie();
+void handle_server_message(const char message[]) {
+    if (strcmp(message, "PONG") == 0) {
+        return;
+    }
+
+    // Answers the server's heartbeat so that it does not reap the connection.
+    if (strcmp(message, "PING") == 0) {
+        send_to_server("PONG");
+        return;
+    }
+
+    if (message[0] != '@') {
+        if (strcmp(message, "ERROR") == 0) {
+            puts("Invalid input!");
+        } else {
+            puts(message);
+        }
+        return;
+    }
+
+    char *body;
+    int id = strtol(message + 1, &body, 10);
+    if (*body == '\n') {
+        body++;
+    }
 
-    // Creates the socket.
-    server_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (strcmp(body, "ERROR") == 0) {
+        printf("Invalid input for Session #%d!\n", id);
+        return;
+    }
+
+    std::vector<int>::iterator it = std::find(session_ids.begin(), session_ids.end(), id);
+    if (strcmp(body, "UNSUB") == 0) {
+        if (it != session_ids.end()) {
+            session_ids.erase(it);
+            save_cookie();
+        }
+        printf("Left Session #%d.\n", id);
+        return;
+    }
+
+    if (it == session_ids.end()) {
+        session_ids.push_back(id);
+        save_cookie();
+    }
+    printf("Session #%d:\n%s\n", id, body);
+}
+
+/**
+ * Queues the message to the server and writes as much as the socket takes;
+ * the rest is written once poll() reports the socket writable.
+ *
+ * @param message the message to send
+ */
+void send_to_server(const char message[]) {
+    frame_t *frame = frame_create(message, strlen(message));
+    outbound_push(&server_outbound, frame);
+    frame_release(frame);
+
+    if (!outbound_flush(&server_outbound, server_socket_fd)) {
+        schedule_reconnect("Lost the connection to the server");
+    }
+}
+
+/**
+ * Starts a non-blocking connection attempt to the server. The registration is sent
+ * as soon as the connection is established.
+ */
+void connect_server() {
+    server_socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (server_socket_fd < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
 
-    // Connects to the server via socket.
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(host_ip);
-    server_addr.sin_port = htons(port);
+    outbound_attach(&server_outbound, server_socket_fd, false);
+    frame_decoder_reset(&server_decoder);
+    last_received_at = now_ms();
+    last_ping_at = last_received_at;
 
-    if (connect(server_socket_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
-        perror("Socket connect failed");
-        exit(EXIT_FAILURE);
+    if (connect(server_socket_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == 0) {
+        on_connected();
+    } else if (errno == EINPROGRESS) {
+        state = CONNECTING;
+    } else {
+        schedule_reconnect(strerror(errno));
     }
-    printf("Connected to %s:%d.\n", host_ip, port);
+}
 
-    // Gets the final session ID.
-    register_server();
-    printf("Running Session #%d:\n", session_id);
+/**
+ * Sends the registration once the connection to the server is established.
+ */
+void on_connected() {
+#ifdef USE_TLS
+    // Reconnections resume the cached session, which skips the certificate exchange.
+    if (tls_enabled) {
+        bool resumed;
+        if (!tls_connect(server_socket_fd, inet_ntoa(server_addr.sin_addr), &resumed)) {
+            schedule_reconnect("The TLS handshake failed");
+            return;
+        }
+        printf("Connected to %s:%d over TLS (%s).\n", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port),
+               resumed ? "resumed session" : "full handshake");
+    } else
+#endif
+    printf("Connected to %s:%d.\n", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
+    state = REGISTERING;
+    send_to_server(build_registration().c_str());
+}
 
-    // Saves the session ID to the cookie on the disk.
-    save_cookie();
+/**
+ * Closes the connection and schedules a reconnection. The delay doubles after every
+ * failed attempt up to RECONNECT_MAX_MS, with some jitter so that many browsers
+ * do not reconnect in lockstep.
+ *
+ * @param reason why the connection is being dropped
+ */
+void schedule_reconnect(const char reason[]) {
+    if (server_socket_fd >= 0) {
+        outbound_clear(&server_outbound);
+#ifdef USE_TLS
+        tls_close(server_socket_fd);
+#endif
+        close(server_socket_fd);
+        server_socket_fd = -1;
+    }
+
+    long long delay = reconnect_delay / 2 + rand() % (reconnect_delay / 2 + 1);
+    printf("%s; reconnecting in %lld ms.\n", reason, delay);
+
+    state = DISCONNECTED;
+    reconnect_at = now_ms() + delay;
+    reconnect_delay = std::min(reconnect_delay * 2, (long long) RECONNECT_MAX_MS);
+}
+
+/**
+ * Reads everything the server has sent and handles every complete frame.
+ * The frames sent right before the server closed the connection are handled too,
+ * so that a refused registration shows as such.
+ */
+void receive_from_server() {
+    char buffer[16 * 1024];
+    bool closed = false;
+
+    while (server_socket_fd >= 0) {
+        ssize_t n = socket_receive(server_socket_fd, buffer, sizeof(buffer));
+        if (n == 0) {
+            closed = true;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                schedule_reconnect(strerror(errno));
+            }
+            break;
+        }
+
+        last_received_at = now_ms();
+        frame_decoder_feed(&server_decoder, buffer, n);
+    }
+
+    std::string payload;
+    int result;
+    while (server_socket_fd >= 0 && (result = frame_decoder_next(&server_decoder, payload)) != 0) {
+        if (result < 0) {
+            schedule_reconnect("The server sent a malformed frame");
+            return;
+        }
+
+        if (state == REGISTERING) {
+            if (!handle_registration(payload.c_str())) {
+                schedule_reconnect(strcmp(payload.c_str(), "ERROR") == 0 ? "The server refused the registration"
+                                                                         : "The server sent an invalid registration reply");
+                return;
+            }
+        } else {
+            handle_server_message(payload.c_str());
+        }
+    }
 
-	pthread_t server_listener_id;
-	pthread_create(&server_listener_id, NULL, &server_listener, &server_listener_id);
+    if (closed && server_socket_fd >= 0) {
+        schedule_reconnect("The server closed the connection");
+    }
+}
+
+/**
+ * Reads everything available on stdin and handles every complete line.
+ */
+void read_user_input() {
+    char buffer[BUFFER_LEN];
+    ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+
+    if (n < 0 && errno == EINTR) {
+        return;
+    }
+    if (n <= 0) {
+        // The end of the input ends the browser, like typing "exit".
+        handle_user_input("exit");
+        return;
+    }
+
+    input_buffer.append(buffer, n);
+
+    size_t newline;
+    while (browser_on && (newline = input_buffer.find('\n')) != std::string::npos) {
+        std::string line = input_buffer.substr(0, newline);
+        input_buffer.erase(0, newline + 1);
+        if (line.size() >= BUFFER_LEN) {
+            line.resize(BUFFER_LEN - 1);
+        }
+        handle_user_input(line.c_str());
+    }
+}
 
-    // Main loop to read in the user's input and send it out.
+/**
+ * Checks the keepalive timers of a live connection. The server is pinged after
+ * KEEPALIVE_INTERVAL_MS of silence and dropped after KEEPALIVE_TIMEOUT_MS.
+ *
+ * @param now the current time
+ */
+void check_keepalive(long long now) {
+    if (now - last_received_at >= KEEPALIVE_TIMEOUT_MS) {
+        schedule_reconnect("The server stopped responding");
+        return;
+    }
+
+    if (state == CONNECTED && now - last_received_at >= KEEPALIVE_INTERVAL_MS
+        && now - last_ping_at >= KEEPALIVE_INTERVAL_MS) {
+        last_ping_at = now;
+        send_to_server("PING");
+    }
+}
+
+/**
+ * Starts the browser. Runs a single poll loop over stdin, the server socket and
+ * the timers until the user exits. The connection is re-established with backoff
+ * whenever it drops, keeping the session IDs from the cookie.
+ *
+ * @param host_ip the host ip to connect
+ * @param port the host port to connect
+ */
+void start_browser(const char host_ip[], int port) {
+    // Loads the cookies if there exists one on the disk.
+    load_cookie();
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(host_ip);
+    server_addr.sin_port = htons(port);
+
+    srand((unsigned) time(NULL) ^ (unsigned) getpid());
+    outbound_init(&server_outbound);
+    connect_server();
+
+    // Main loop over stdin, the server socket and the timers.
     while (browser_on) {
-        char message[BUFFER_LEN];
-        read_user_input(message);
-        send_message(server_socket_fd, message);
+        long long now = now_ms();
+        struct pollfd fds[2];
+        int num_fds = 0;
+        int timeout;
+
+        if (state == DISCONNECTED) {
+            if (now >= reconnect_at) {
+                connect_server();
+                continue;
+            }
+            timeout = (int) (reconnect_at - now);
+        } else {
+            check_keepalive(now);
+            if (state == DISCONNECTED) {
+                continue;
+            }
+
+            long long next = std::min(last_received_at + KEEPALIVE_TIMEOUT_MS,
+                                      std::max(last_received_at, last_ping_at) + KEEPALIVE_INTERVAL_MS);
+            timeout = (int) std::max(next - now, 0LL);
+
+            fds[num_fds].fd = server_socket_fd;
+            fds[num_fds].events = POLLIN;
+            if (state == CONNECTING || outbound_has_pending(&server_outbound)) {
+                fds[num_fds].events |= POLLOUT;
+            }
+            num_fds++;
+        }
+
+        if (!monitor_only) {
+            fds[num_fds].fd = STDIN_FILENO;
+            fds[num_fds].events = POLLIN;
+            num_fds++;
+        }
+
+        if (poll(fds, num_fds, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Poll failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < num_fds && browser_on; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+
+            if (fds[i].fd == STDIN_FILENO) {
+                read_user_input();
+                continue;
+            }
+
+            if (fds[i].fd != server_socket_fd) {
+                continue;
+            }
+
+            if (state == CONNECTING) {
+                int error = 0;
+                socklen_t len = sizeof(error);
+                getsockopt(server_socket_fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                if (error != 0) {
+                    schedule_reconnect(strerror(error));
+                    continue;
+                }
+
+                on_connected();
+                continue;
+            }
+
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                receive_from_server();
+            }
+            if (server_socket_fd >= 0 && (fds[i].revents & POLLOUT)
+                && !outbound_flush(&server_outbound, server_socket_fd)) {
+                schedule_reconnect("Lost the connection to the server");
+            }
+        }
     }
 
-    // Closes the socket.
-    close(server_socket_fd);
+    // Writes out the final "exit" before closing the socket.
+    if (server_socket_fd >= 0) {
+        fcntl(server_socket_fd, F_SETFL, fcntl(server_socket_fd, F_GETFL) & ~O_NONBLOCK);
+        outbound_flush(&server_outbound, server_socket_fd);
+        outbound_clear(&server_outbound);
+#ifdef USE_TLS
+        tls_close(server_socket_fd);
+#endif
+        close(server_socket_fd);
+    }
     printf("Closed the connection to %s:%d.\n", host_ip, port);
 }
 
@@ -223,27 +666,35 @@ void start_browser(const char host_ip[], int port) {
  * @return exit code
  */
 int main(int argc, char *argv[]) {
-    char *host_ip = DEFAULT_HOST_IP;
+    const char *host_ip = DEFAULT_HOST_IP;
     int port = DEFAULT_PORT;
+    const char *tls_ca_path = NULL;
 
-    if (argc == 1) {
-    } else if ((argc == 3)
-               && ((strcmp(argv[1], "--host") == 0) || (strcmp(argv[1], "-h") == 0))) {
-        host_ip = argv[2];
+    for (int i = 1; i < argc; i++) {
+        if (((strcmp(argv[i], "--host") == 0) || (strcmp(argv[i], "-h") == 0)) && (i + 1 < argc)) {
+            host_ip = argv[++i];
 
-    } else if ((argc == 3)
-               && ((strcmp(argv[1], "--port") == 0) || (strcmp(argv[1], "-p") == 0))) {
-        port = strtol(argv[2], NULL, 10);
+        } else if (((strcmp(argv[i], "--port") == 0) || (strcmp(argv[i], "-p") == 0)) && (i + 1 < argc)) {
+            port = strtol(argv[++i], NULL, 10);
 
-    } else if ((argc == 5)
-               && ((strcmp(argv[1], "--host") == 0) || (strcmp(argv[1], "-h") == 0))
-               && ((strcmp(argv[3], "--port") == 0) || (strcmp(argv[3], "-p") == 0))) {
-        host_ip = argv[2];
-        port = strtol(argv[4], NULL, 10);
+        } else if ((strcmp(argv[i], "--mux") == 0) || (strcmp(argv[i], "-m") == 0)) {
+            multiplexed = true;
 
-    } else {
-        puts("Invalid arguments.");
-        exit(EXIT_FAILURE);
+        } else if (strcmp(argv[i], "--monitor") == 0) {
+            monitor_only = true;
+
+        } else if (strcmp(argv[i], "--tls") == 0) {
+            tls_enabled = true;
+
+        } else if ((strcmp(argv[i], "--tls-ca") == 0) && (i + 1 < argc)) {
+            // The server's certificate is checked against this CA instead of the system's.
+            tls_enabled = true;
+            tls_ca_path = argv[++i];
+
+        } else {
+            puts("Invalid arguments.");
+            exit(EXIT_FAILURE);
+        }
     }
 
     if (port < 1024) {
@@ -251,6 +702,18 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    if (tls_enabled) {
+#ifdef USE_TLS
+        if (!tls_client_init(tls_ca_path, TLS_SESSION_PATH)) {
+            exit(EXIT_FAILURE);
+        }
+#else
+        (void) tls_ca_path;
+        puts("This browser was built without TLS; rebuild it with \"make TLS=1\".");
+        exit(EXIT_FAILURE);
+#endif
+    }
+
     // Starts the browser using the given host IP and port
     start_browser(host_ip, port);
 
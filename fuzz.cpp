@@ -0,0 +1,229 @@
+/*
+ ***************************************************************************
+ * Clarkson University                                                     *
+ * CS 444/544: Operating Systems, Spring 2024                              *
+ * Project: Prototyping a Web Server/Browser                               *
+ * Created by Daqing Hou, dhou@clarkson.edu                                *
+ *            Xinchao Song, xisong@clarkson.edu                            *
+ * April 10, 2022                                                          *
+ * Copyright © 2022-2024 CS 444/544 Instructor Team. All rights reserved.  *
+ * Unauthorized use is strictly prohibited.                                *
+ ***************************************************************************
+ */
+
+// A fuzzing harness for one target, chosen at compile time with -DFUZZ_TARGET=<function>.
+// Built with -fsanitize=fuzzer and -DLIBFUZZER, libFuzzer drives it. Otherwise the standalone
+// driver below does: it runs one input from stdin, which is what AFL expects, or every file
+// given, and can mutate those files at random where no coverage-guided fuzzer is available.
+
+#include "fuzz_targets.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifndef FUZZ_TARGET
+#error "Build with -DFUZZ_TARGET=fuzz_commands, fuzz_session_file or fuzz_frames."
+#endif
+
+#define MAX_INPUT_LEN 4096      // The longest input the mutator builds, like libFuzzer's default.
+
+/**
+ * Runs one input through the target.
+ *
+ * @param data the input
+ * @param size the input's length
+ * @return 0, as libFuzzer requires
+ */
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+    FUZZ_TARGET(data, size);
+    return 0;
+}
+
+#ifndef LIBFUZZER
+// Reads a whole file or stream into an input.
+bool read_input(FILE * file, std::string & input);
+
+// Adds the file, or every file in the directory, to the inputs.
+void add_inputs(const char path[], std::vector<std::string> & inputs);
+
+// Changes an input at random: flips bits, overwrites, inserts or deletes bytes,
+// or splices in part of another input.
+void mutate(std::string & input, const std::vector<std::string> & inputs);
+
+/**
+ * Reads a whole file or stream into an input.
+ *
+ * @param file the file
+ * @param input set to its contents
+ * @return false if it could not be read
+ */
+bool read_input(FILE * file, std::string & input) {
+    char buffer[4096];
+    size_t n;
+
+    input.clear();
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        input.append(buffer, n);
+    }
+    return !ferror(file);
+}
+
+/**
+ * Adds the file, or every file in the directory, to the inputs.
+ * Exits if the path cannot be read.
+ *
+ * @param path the file or directory
+ * @param inputs the inputs
+ */
+void add_inputs(const char path[], std::vector<std::string> & inputs) {
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        fprintf(stderr, "Cannot read %s.\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (S_ISDIR(info.st_mode)) {
+        DIR *dir = opendir(path);
+        std::vector<std::string> names;
+        struct dirent *entry;
+        while (dir != NULL && (entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                names.push_back(std::string(path) + "/" + entry->d_name);
+            }
+        }
+        if (dir != NULL) {
+            closedir(dir);
+        }
+
+        // Sorted, so that runs are repeatable.
+        std::sort(names.begin(), names.end());
+        for (size_t i = 0; i < names.size(); i++) {
+            add_inputs(names[i].c_str(), inputs);
+        }
+        return;
+    }
+
+    FILE *file = fopen(path, "rb");
+    std::string input;
+    if (file == NULL || !read_input(file, input)) {
+        fprintf(stderr, "Cannot read %s.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    inputs.push_back(input);
+}
+
+/**
+ * Changes an input at random.
+ *
+ * @param input the input to change
+ * @param inputs every input, for splicing
+ */
+void mutate(std::string & input, const std::vector<std::string> & inputs) {
+    int changes = 1 + rand() % 4;
+
+    for (int i = 0; i < changes; i++) {
+        size_t pos = input.empty() ? 0 : rand() % input.size();
+
+        switch (rand() % 5) {
+            case 0:
+                if (!input.empty()) {
+                    input[pos] ^= 1 << (rand() % 8);
+                }
+                break;
+            case 1:
+                if (!input.empty()) {
+                    // Favors the bytes the parsers care about.
+                    static const char interesting[] = " =+-*/[],.0123456789eE\n@ATUNDOIF";
+                    input[pos] = (rand() % 2) ? interesting[rand() % (sizeof(interesting) - 1)] : rand() % 256;
+                }
+                break;
+            case 2:
+                input.insert(pos, 1 + rand() % 8, (char) (rand() % 256));
+                break;
+            case 3:
+                if (!input.empty()) {
+                    input.erase(pos, 1 + rand() % std::min(input.size() - pos, (size_t) 16));
+                }
+                break;
+            default: {
+                const std::string &other = inputs[rand() % inputs.size()];
+                if (!other.empty()) {
+                    size_t from = rand() % other.size();
+                    input.insert(pos, other, from, 1 + rand() % (other.size() - from));
+                }
+                break;
+            }
+        }
+    }
+
+    if (input.size() > MAX_INPUT_LEN) {
+        input.resize(MAX_INPUT_LEN);
+    }
+}
+
+/**
+ * Runs the target over one input from stdin, or over every file given. With "-runs=<n>",
+ * also runs n random mutations of those files; "-seed=<s>" makes them repeatable.
+ * The flags are spelled like libFuzzer's, so the same command line drives either build.
+ * A crash aborts with the sanitizer's report, and the input that caused it is saved
+ * to ./crash-input first.
+ *
+ * @param argc the number of command-line arguments passed by the user
+ * @param argv the array that contains all the arguments
+ * @return exit code
+ */
+int main(int argc, char *argv[]) {
+    std::vector<std::string> inputs;
+    long runs = 0;
+    unsigned seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-runs=", 6) == 0) {
+            runs = strtol(argv[i] + 6, NULL, 10);
+        } else if (strncmp(argv[i], "-seed=", 6) == 0) {
+            seed = strtoul(argv[i] + 6, NULL, 10);
+        } else {
+            add_inputs(argv[i], inputs);
+        }
+    }
+
+    if (inputs.empty()) {
+        std::string input;
+        if (!read_input(stdin, input)) {
+            fputs("Cannot read stdin.\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+        inputs.push_back(input);
+    }
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        LLVMFuzzerTestOneInput((const uint8_t *) inputs[i].data(), inputs[i].size());
+    }
+
+    srand(seed);
+    for (long run = 0; run < runs; run++) {
+        std::string input = inputs[rand() % inputs.size()];
+        mutate(input, inputs);
+
+        // Written before the run, so it survives a crash.
+        FILE *crash = fopen("crash-input", "wb");
+        if (crash != NULL) {
+            fwrite(input.data(), 1, input.size(), crash);
+            fclose(crash);
+        }
+        LLVMFuzzerTestOneInput((const uint8_t *) input.data(), input.size());
+    }
+    remove("crash-input");
+
+    printf("Ran %zu inputs and %ld mutations.\n", inputs.size(), runs);
+    return EXIT_SUCCESS;
+}
+#endif
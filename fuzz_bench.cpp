@@ -0,0 +1,261 @@
+/*
+ ***************************************************************************
+ * Clarkson University                                                     *
+ * CS 444/544: Operating Systems, Spring 2024                              *
+ * Project: Prototyping a Web Server/Browser                               *
+ * Created by Daqing Hou, dhou@clarkson.edu                                *
+ *            Xinchao Song, xisong@clarkson.edu                            *
+ * April 10, 2022                                                          *
+ * Copyright © 2022-2024 CS 444/544 Instructor Team. All rights reserved.  *
+ * Unauthorized use is strictly prohibited.                                *
+ ***************************************************************************
+ */
+
+#include "fuzz_targets.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <inttypes.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define CORPUS_DIR "corpus"
+#define DIGESTS_PATH "corpus/digests"   // The expected digest of every benchmark, one "<name> <digest>" per line.
+#define MIN_BENCH_NS 200000000LL        // Nanoseconds each benchmark runs for at least.
+
+// A benchmark: one target run over every input of its corpus directory.
+typedef struct benchmark_struct {
+    const char *name;
+    const char *corpus;
+    fuzz_target_t target;
+} benchmark_t;
+
+// The result of a benchmark.
+typedef struct bench_result_struct {
+    double real_ns;         // Wall-clock nanoseconds per pass over the corpus.
+    double cpu_ns;          // CPU nanoseconds per pass over the corpus.
+    long long iterations;   // Timed passes.
+    double bytes_per_s;     // Input bytes parsed per second.
+    uint64_t digest;        // The digest of the outputs of one pass.
+    bool stable;            // Set if every timed pass had the same digest.
+} bench_result_t;
+
+static const benchmark_t benchmarks[] = {
+    {"BM_commands", CORPUS_DIR "/commands", fuzz_commands},
+    {"BM_session_file", CORPUS_DIR "/session_files", fuzz_session_file},
+    {"BM_frames", CORPUS_DIR "/frames", fuzz_frames},
+};
+
+// Returns the time of the given clock in nanoseconds.
+long long clock_ns(clockid_t clock);
+
+// Reads every file of a corpus directory, in name order.
+std::vector<std::string> load_corpus(const char dir[]);
+
+// Runs the target once over every input and returns the digest of all the outputs.
+uint64_t run_pass(fuzz_target_t target, const std::vector<std::string> & inputs);
+
+// Times passes of the target over the inputs.
+bench_result_t run_benchmark(fuzz_target_t target, const std::vector<std::string> & inputs);
+
+// Looks up the expected digest of a benchmark.
+bool expected_digest(const char name[], uint64_t * digest);
+
+/**
+ * Returns the time of the given clock in nanoseconds.
+ *
+ * @param clock the clock
+ * @return the current time
+ */
+long long clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Reads every file of a corpus directory, in name order. Exits if the directory is missing.
+ *
+ * @param dir the directory
+ * @return the contents of its files
+ */
+std::vector<std::string> load_corpus(const char dir[]) {
+    std::vector<std::string> names;
+    std::vector<std::string> inputs;
+
+    DIR *handle = opendir(dir);
+    if (handle == NULL) {
+        fprintf(stderr, "Cannot read %s; run the benchmark from the project directory.\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(handle)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            names.push_back(std::string(dir) + "/" + entry->d_name);
+        }
+    }
+    closedir(handle);
+    std::sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++) {
+        FILE *file = fopen(names[i].c_str(), "rb");
+        if (file == NULL) {
+            continue;
+        }
+        std::string input;
+        char buffer[4096];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            input.append(buffer, n);
+        }
+        fclose(file);
+        inputs.push_back(input);
+    }
+
+    return inputs;
+}
+
+/**
+ * Runs the target once over every input and returns the digest of all the outputs.
+ *
+ * @param target the target
+ * @param inputs the inputs
+ * @return the digest
+ */
+uint64_t run_pass(fuzz_target_t target, const std::vector<std::string> & inputs) {
+    uint64_t digest = DIGEST_INIT;
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        uint64_t input_digest = target((const uint8_t *) inputs[i].data(), inputs[i].size());
+        digest = digest_bytes(digest, &input_digest, sizeof(input_digest));
+    }
+    return digest;
+}
+
+/**
+ * Times passes of the target over the inputs until MIN_BENCH_NS have gone by,
+ * after one untimed pass that sets the digest every timed pass must match.
+ *
+ * @param target the target
+ * @param inputs the inputs
+ * @return the timings and the digest
+ */
+bench_result_t run_benchmark(fuzz_target_t target, const std::vector<std::string> & inputs) {
+    bench_result_t result;
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        bytes += inputs[i].size();
+    }
+
+    result.digest = run_pass(target, inputs);
+    result.stable = true;
+    result.iterations = 0;
+
+    long long real_start = clock_ns(CLOCK_MONOTONIC);
+    long long cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    long long real_elapsed;
+    do {
+        result.stable = (run_pass(target, inputs) == result.digest) && result.stable;
+        result.iterations++;
+        real_elapsed = clock_ns(CLOCK_MONOTONIC) - real_start;
+    } while (real_elapsed < MIN_BENCH_NS);
+    long long cpu_elapsed = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+
+    result.real_ns = (double) real_elapsed / result.iterations;
+    result.cpu_ns = (double) cpu_elapsed / result.iterations;
+    result.bytes_per_s = bytes * 1e9 / result.real_ns;
+    return result;
+}
+
+/**
+ * Looks up the expected digest of a benchmark in DIGESTS_PATH.
+ *
+ * @param name the benchmark's name
+ * @param digest set to the expected digest
+ * @return false if the benchmark has none
+ */
+bool expected_digest(const char name[], uint64_t * digest) {
+    FILE *file = fopen(DIGESTS_PATH, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    char line[256];
+    char entry_name[128];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file) != NULL) {
+        found = sscanf(line, "%127s %" SCNx64, entry_name, digest) == 2 && strcmp(entry_name, name) == 0;
+    }
+    fclose(file);
+    return found;
+}
+
+/**
+ * Runs every benchmark over its corpus and prints a table like Google Benchmark's, plus the
+ * digest of each benchmark's outputs. Fails if a digest differs from the one recorded in
+ * DIGESTS_PATH, so a faster parser is known to give the same answers. "--update" records
+ * the current digests instead, after a deliberate change of behavior or of the corpus.
+ *
+ * @param argc the number of command-line arguments passed by the user
+ * @param argv the array that contains all the arguments
+ * @return exit code
+ */
+int main(int argc, char *argv[]) {
+    bool update = (argc > 1) && (strcmp(argv[1], "--update") == 0);
+    int num_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    bool ok = true;
+    std::string digests;
+
+    printf("%-24s %14s %14s %12s %12s  %-18s\n", "Benchmark", "Time", "CPU", "Iterations", "Throughput", "Digest");
+    printf("%.*s\n", 100, "----------------------------------------------------------------------------------------------------");
+
+    for (int i = 0; i < num_benchmarks; i++) {
+        std::vector<std::string> inputs = load_corpus(benchmarks[i].corpus);
+        bench_result_t result = run_benchmark(benchmarks[i].target, inputs);
+
+        char name[64];
+        snprintf(name, sizeof(name), "%s/%zu", benchmarks[i].name, inputs.size());
+        printf("%-24s %11.0f ns %11.0f ns %12lld %7.1f MB/s  %016" PRIx64, name, result.real_ns, result.cpu_ns,
+               result.iterations, result.bytes_per_s / 1e6, result.digest);
+
+        char entry[128];
+        snprintf(entry, sizeof(entry), "%s %016" PRIx64 "\n", benchmarks[i].name, result.digest);
+        digests += entry;
+
+        uint64_t expected;
+        if (!result.stable) {
+            printf("  FAIL: passes disagree\n");
+            ok = false;
+        } else if (update) {
+            printf("\n");
+        } else if (!expected_digest(benchmarks[i].name, &expected)) {
+            printf("  FAIL: no recorded digest\n");
+            ok = false;
+        } else if (expected != result.digest) {
+            printf("  FAIL: expected %016" PRIx64 "\n", expected);
+            ok = false;
+        } else {
+            printf("  ok\n");
+        }
+    }
+
+    if (update) {
+        FILE *file = fopen(DIGESTS_PATH, "w");
+        if (file == NULL) {
+            perror("Cannot write " DIGESTS_PATH);
+            return EXIT_FAILURE;
+        }
+        fputs(digests.c_str(), file);
+        fclose(file);
+        printf("Recorded the digests in %s.\n", DIGESTS_PATH);
+    }
+
+    printf("%s\n", ok ? "PASS" : "FAIL: the outputs changed; run ./fuzz_bench --update if that was intended");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,174 @@
+/*
+ ***************************************************************************
+ * Clarkson University                                                     *
+ * CS 444/544: Operating Systems, Spring 2024                              *
+ * Project: Prototyping a Web Server/Browser                               *
+ * Created by Daqing Hou, dhou@clarkson.edu                                *
+ *            Xinchao Song, xisong@clarkson.edu                            *
+ * April 10, 2022                                                          *
+ * Copyright © 2022-2024 CS 444/544 Instructor Team. All rights reserved.  *
+ * Unauthorized use is strictly prohibited.                                *
+ ***************************************************************************
+ */
+
+#include "fuzz_targets.hpp"
+#include "net_util.hpp"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+
+// Defined in server.cpp, which is linked in with SERVER_NO_MAIN.
+bool execute_command(int session_id, const char command[], std::string & response, bool * mutated);
+bool load_session_stream(int session_id, std::istream & session_file);
+void session_to_str(int session_id, size_t max_elements, std::string & result);
+void discard_session(int session_id);
+void get_history_file_path(int session_id, char path[]);
+
+// The most elements of a loaded vector that go into a digest.
+#define DIGEST_MAX_ELEMENTS 64
+
+// Returns a chunk length between 1 and 61 taken from the input itself, so that the same input
+// always splits the same way while different inputs cover different frame boundaries.
+static size_t chunk_len(uint8_t byte);
+
+// Empties the scratch session, including any history it spilled to the disk.
+static void clear_scratch_session();
+
+/**
+ * Folds bytes into a 64-bit FNV-1a digest.
+ *
+ * @param digest the digest so far, or DIGEST_INIT
+ * @param data the bytes
+ * @param len the number of bytes
+ * @return the new digest
+ */
+uint64_t digest_bytes(uint64_t digest, const void * data, size_t len) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < len; i++) {
+        digest ^= bytes[i];
+        digest *= 0x100000001b3ULL;
+    }
+    return digest;
+}
+
+/**
+ * Returns a chunk length taken from the input itself.
+ *
+ * @param byte a byte of the input
+ * @return a length between 1 and 61
+ */
+static size_t chunk_len(uint8_t byte) {
+    return byte % 61 + 1;
+}
+
+/**
+ * Empties the scratch session, including any history it spilled to the disk.
+ */
+static void clear_scratch_session() {
+    char path[BUFFER_LEN];
+
+    discard_session(FUZZ_SESSION);
+    get_history_file_path(FUZZ_SESSION, path);
+    unlink(path);
+}
+
+/**
+ * Runs every line of the input as a browser command against a scratch session,
+ * the way a browser handler runs what it receives. A line is cut at its first NUL
+ * and at BUFFER_LEN - 1 characters, like a received message.
+ *
+ * @param data the input
+ * @param size the input's length
+ * @return the digest of every command's outcome and answer
+ */
+uint64_t fuzz_commands(const uint8_t data[], size_t size) {
+    uint64_t digest = DIGEST_INIT;
+    size_t start = 0;
+
+    while (start < size) {
+        const uint8_t *newline = (const uint8_t *) memchr(data + start, '\n', size - start);
+        size_t end = (newline != NULL) ? newline - data : size;
+
+        char command[BUFFER_LEN];
+        size_t len = std::min(end - start, (size_t) BUFFER_LEN - 1);
+        memcpy(command, data + start, len);
+        command[len] = '\0';
+        start = end + 1;
+
+        if (command[0] == '\0') {
+            continue;
+        }
+
+        std::string response;
+        bool mutated = false;
+        bool valid = execute_command(FUZZ_SESSION, command, response, &mutated);
+
+        uint8_t flags = (valid ? 1 : 0) | (mutated ? 2 : 0);
+        digest = digest_bytes(digest, &flags, sizeof(flags));
+        digest = digest_bytes(digest, response.data(), response.size());
+    }
+
+    clear_scratch_session();
+    return digest;
+}
+
+/**
+ * Loads the input as a session file into a scratch session.
+ *
+ * @param data the input
+ * @param size the input's length
+ * @return the digest of whether the file loaded and of what it loaded
+ */
+uint64_t fuzz_session_file(const uint8_t data[], size_t size) {
+    std::istringstream session_file(std::string((const char *) data, size));
+    std::string loaded;
+
+    uint8_t valid = load_session_stream(FUZZ_SESSION, session_file) ? 1 : 0;
+    session_to_str(FUZZ_SESSION, DIGEST_MAX_ELEMENTS, loaded);
+
+    uint64_t digest = digest_bytes(DIGEST_INIT, &valid, sizeof(valid));
+    digest = digest_bytes(digest, loaded.data(), loaded.size());
+
+    clear_scratch_session();
+    return digest;
+}
+
+/**
+ * Feeds the input to a frame decoder in uneven chunks, taking out every complete frame
+ * after each one, like a browser reading from its socket. Decoding stops at the first
+ * malformed frame, where a browser would drop the connection.
+ *
+ * @param data the input
+ * @param size the input's length
+ * @return the digest of every frame payload and of whether the stream was malformed
+ */
+uint64_t fuzz_frames(const uint8_t data[], size_t size) {
+    frame_decoder_t decoder;
+    std::string payload;
+    uint64_t digest = DIGEST_INIT;
+    size_t offset = 0;
+
+    frame_decoder_reset(&decoder);
+    while (offset < size) {
+        size_t len = std::min(chunk_len(data[offset]), size - offset);
+        frame_decoder_feed(&decoder, (const char *) data + offset, len);
+        offset += len;
+
+        int result;
+        while ((result = frame_decoder_next(&decoder, payload)) == 1) {
+            uint32_t payload_len = payload.size();
+            digest = digest_bytes(digest, &payload_len, sizeof(payload_len));
+            digest = digest_bytes(digest, payload.data(), payload.size());
+        }
+        if (result < 0) {
+            uint8_t malformed = 0xff;
+            return digest_bytes(digest, &malformed, sizeof(malformed));
+        }
+    }
+
+    return digest;
+}
@@ -0,0 +1,42 @@
+/*
+ ***************************************************************************
+ * Clarkson University                                                     *
+ * CS 444/544: Operating Systems, Spring 2024                              *
+ * Project: Prototyping a Web Server/Browser                               *
+ * Created by Daqing Hou, dhou@clarkson.edu                                *
+ *            Xinchao Song, xisong@clarkson.edu                            *
+ * April 10, 2022                                                          *
+ * Copyright © 2022-2024 CS 444/544 Instructor Team. All rights reserved.  *
+ * Unauthorized use is strictly prohibited.                                *
+ ***************************************************************************
+ */
+
+#ifndef PROJECT_FUZZ_TARGETS_H
+#define PROJECT_FUZZ_TARGETS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The session every target works on. No browser can reach a negative ID,
+// so a spilled history file can never belong to a real session.
+#define FUZZ_SESSION (-1)
+
+// The starting value of a digest.
+#define DIGEST_INIT 0xcbf29ce484222325ULL
+
+// A target: runs one input and returns the digest of everything it produced.
+typedef uint64_t (*fuzz_target_t)(const uint8_t data[], size_t size);
+
+// Folds bytes into a 64-bit FNV-1a digest.
+uint64_t digest_bytes(uint64_t digest, const void * data, size_t len);
+
+// Runs every line of the input as a browser command against a scratch session.
+uint64_t fuzz_commands(const uint8_t data[], size_t size);
+
+// Loads the input as a session file into a scratch session.
+uint64_t fuzz_session_file(const uint8_t data[], size_t size);
+
+// Feeds the input to a frame decoder in uneven chunks and takes out every frame.
+uint64_t fuzz_frames(const uint8_t data[], size_t size);
+
+#endif //PROJECT_FUZZ_TARGETS_H
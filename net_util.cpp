@@ -13,29 +13,1000 @@
 
 #include "net_util.hpp"
 
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef USE_TLS
+#include <stdio.h>
+#include <signal.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+
+// The TLS state of one socket, indexed by its descriptor. The slots are never freed, so a
+// thread still holding a descriptor that was just closed finds an empty slot instead of freed memory.
+// A zero-filled mutex is a valid PTHREAD_MUTEX_INITIALIZER.
+typedef struct tls_socket_struct {
+    pthread_mutex_t mutex;  // Serializes SSL_read() and SSL_write(), which must not run concurrently.
+    SSL *ssl;               // NULL if the socket does not use TLS.
+    bool kernel_send;       // Set if kTLS encrypts what is sent, so the socket can be written directly.
+} tls_socket_t;
+
+static tls_socket_t tls_sockets[TLS_MAX_FD];   // The TLS state of every socket.
+static SSL_CTX *server_ctx = NULL;              // Used to accept TLS connections.
+static SSL_CTX *client_ctx = NULL;              // Used to open TLS connections.
+static SSL_SESSION *client_session = NULL;      // The latest resumable session from a server.
+static char *client_session_path = NULL;        // Where the resumable session is cached between runs.
+static pthread_mutex_t client_session_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Locks the TLS state of the socket if it uses TLS.
+ *
+ * @param socket_fd the socket
+ * @return the socket's TLS state, locked, or NULL if it does not use TLS
+ */
+static tls_socket_t * tls_lock(int socket_fd) {
+    if (socket_fd < 0 || socket_fd >= TLS_MAX_FD) {
+        return NULL;
+    }
+
+    tls_socket_t *tls = &tls_sockets[socket_fd];
+    if (__atomic_load_n(&tls->ssl, __ATOMIC_ACQUIRE) == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&tls->mutex);
+    if (tls->ssl == NULL) {
+        pthread_mutex_unlock(&tls->mutex);
+        return NULL;
+    }
+    return tls;
+}
+
+/**
+ * Determines if the socket uses TLS.
+ *
+ * @param socket_fd the socket
+ * @return true if the socket has a TLS connection
+ */
+static bool tls_in_use(int socket_fd) {
+    return socket_fd >= 0 && socket_fd < TLS_MAX_FD &&
+           __atomic_load_n(&tls_sockets[socket_fd].ssl, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/**
+ * Determines if data sent on the socket has to be encrypted by SSL_write().
+ *
+ * @param socket_fd the socket
+ * @return false if the socket is plaintext or kTLS encrypts what is written to it
+ */
+static bool tls_needs_write(int socket_fd) {
+    if (socket_fd < 0 || socket_fd >= TLS_MAX_FD) {
+        return false;
+    }
+
+    tls_socket_t *tls = &tls_sockets[socket_fd];
+    return __atomic_load_n(&tls->ssl, __ATOMIC_ACQUIRE) != NULL && !tls->kernel_send;
+}
+#endif
+
+/**
+ * Sends the buffers described by the message header, encrypting them
+ * if the socket uses TLS without kTLS. Behaves like sendmsg().
+ *
+ * @param socket_fd the socket id used to send the data
+ * @param msg the buffers to send
+ * @param flags the flags for sendmsg()
+ * @return the number of bytes sent, or -1 on error
+ */
+static ssize_t socket_send(int socket_fd, struct msghdr * msg, int flags) {
+#ifdef USE_TLS
+    if (tls_needs_write(socket_fd)) {
+        tls_socket_t *tls = tls_lock(socket_fd);
+        if (tls != NULL) {
+            ssize_t total = 0;
+            int error = SSL_ERROR_NONE;
+            size_t i = 0;
+            size_t skip = 0;
+
+            // Small buffers, like a frame header and its payload, are gathered into one record
+            // so they leave in one segment; anything a record can't hold is written in place.
+            // Partial writes are enabled, so each SSL_write() returns once some records went out.
+            while (i < msg->msg_iovlen && error == SSL_ERROR_NONE) {
+                char record[TLS_RECORD_LEN];
+                const char *data = (const char *) msg->msg_iov[i].iov_base + skip;
+                size_t len = msg->msg_iov[i].iov_len - skip;
+
+                if (len < TLS_RECORD_LEN) {
+                    len = 0;
+                    while (i < msg->msg_iovlen && len < TLS_RECORD_LEN) {
+                        size_t piece = std::min(msg->msg_iov[i].iov_len - skip, TLS_RECORD_LEN - len);
+                        memcpy(record + len, (const char *) msg->msg_iov[i].iov_base + skip, piece);
+                        len += piece;
+                        skip += piece;
+                        if (skip == msg->msg_iov[i].iov_len) {
+                            i++;
+                            skip = 0;
+                        }
+                    }
+                    data = record;
+                } else {
+                    i++;
+                    skip = 0;
+                }
+
+                size_t done = 0;
+                while (done < len) {
+                    size_t written;
+                    if (SSL_write_ex(tls->ssl, data + done, len - done, &written) != 1) {
+                        error = SSL_get_error(tls->ssl, 0);
+                        break;
+                    }
+                    done += written;
+                }
+                total += done;
+            }
+            pthread_mutex_unlock(&tls->mutex);
+
+            if (total > 0 || error == SSL_ERROR_NONE) {
+                return total;
+            }
+            errno = (error == SSL_ERROR_WANT_WRITE) ? EAGAIN : EPIPE;
+            return -1;
+        }
+    }
+#endif
+    return sendmsg(socket_fd, msg, flags);
+}
+
+/**
+ * Receives whatever bytes are available on the socket, decrypting them if it uses TLS.
+ * Behaves like recv() without flags: it blocks on a blocking socket and fails with
+ * EAGAIN on a non-blocking one.
+ *
+ * @param socket_fd the socket id used to receive the data
+ * @param buffer an array to store the data
+ * @param len the size of the array
+ * @return the number of bytes received, 0 if the peer closed the connection, or -1 on error
+ */
+ssize_t socket_receive(int socket_fd, char buffer[], size_t len) {
+#ifdef USE_TLS
+    bool blocking = tls_in_use(socket_fd) && !(fcntl(socket_fd, F_GETFL) & O_NONBLOCK);
+
+    for (;;) {
+        tls_socket_t *tls = tls_lock(socket_fd);
+        if (tls == NULL) {
+            break;
+        }
+
+        // Waits without the lock, so other threads can write while the peer is quiet.
+        if (blocking && SSL_pending(tls->ssl) == 0) {
+            pthread_mutex_unlock(&tls->mutex);
+            struct pollfd pfd = {socket_fd, POLLIN, 0};
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                return -1;
+            }
+            tls = tls_lock(socket_fd);
+            if (tls == NULL) {
+                break;
+            }
+        }
+
+        size_t n;
+        int result = SSL_read_ex(tls->ssl, buffer, len, &n);
+        int error = (result == 1) ? SSL_ERROR_NONE : SSL_get_error(tls->ssl, result);
+        pthread_mutex_unlock(&tls->mutex);
+
+        switch (error) {
+            case SSL_ERROR_NONE:
+                return n;
+            case SSL_ERROR_ZERO_RETURN:
+                return 0;
+            case SSL_ERROR_WANT_READ:
+                // Only a handshake record arrived, or a partial record timed out.
+                if (blocking) {
+                    continue;
+                }
+                errno = EAGAIN;
+                return -1;
+            case SSL_ERROR_SYSCALL:
+                if (errno == 0) {
+                    return 0;
+                }
+                return -1;
+            default:
+                errno = ECONNRESET;
+                return -1;
+        }
+    }
+#endif
+    return recv(socket_fd, buffer, len, 0);
+}
+
+/**
+ * Writes every byte described by the given vector, retrying after partial writes.
+ *
+ * @param socket_fd the socket id used to send the data
+ * @param iov the buffers to send; they are modified to track the progress
+ * @param count the number of buffers
+ * @return the number of bytes sent, or -1 on error
+ */
+static ssize_t send_all(int socket_fd, struct iovec iov[], int count) {
+    ssize_t total = 0;
+
+    while (count > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        ssize_t sent = socket_send(socket_fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += sent;
+
+        // Skips over the buffers that were written completely.
+        while (count > 0 && (size_t) sent >= iov[0].iov_len) {
+            sent -= iov[0].iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov[0].iov_base = (char *) iov[0].iov_base + sent;
+            iov[0].iov_len -= sent;
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Reads exactly the given number of bytes from the socket.
+ *
+ * @param socket_fd the socket id used to receive the data
+ * @param buffer an array to store the data
+ * @param len the number of bytes to read
+ * @return len on success, 0 if the peer closed the connection, or -1 on error
+ */
+static ssize_t receive_all(int socket_fd, char buffer[], size_t len) {
+    size_t received = 0;
+
+    while (received < len) {
+        ssize_t n = socket_receive(socket_fd, buffer + received, len - received);
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        received += n;
+    }
+
+    return received;
+}
 
 /**
  * Sends the message through socket.
+ * The message is framed by its length; only the characters of the message are sent.
  *
  * @param socket_fd the socket id used to send the message
  * @param message the message to send
- * @return the number of characters sent
+ * @return the number of characters sent, including the frame header
  */
 ssize_t send_message(int socket_fd, const char message[]) {
-    return send(socket_fd, message, BUFFER_LEN, 0);
+    size_t len = strlen(message);
+    uint32_t header = htonl((uint32_t) len);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = FRAME_HEADER_LEN;
+    iov[1].iov_base = (void *) message;
+    iov[1].iov_len = len;
+
+    return send_all(socket_fd, iov, 2);
 }
 
 /**
  * Receives the message through socket.
+ * Payloads longer than BUFFER_LEN - 1 characters are truncated.
  *
  * @param socket_fd the socket id used to receive the message
  * @param message an array to store the received message;
  *                any data already in the array will be erased
- * @return the number of characters received
+ * @return the number of characters received, 0 if the peer closed the connection, or -1 on error
  */
 ssize_t receive_message(int socket_fd, char message[]) {
     memset(message, 0, BUFFER_LEN);
-    return recv(socket_fd, message, BUFFER_LEN, 0);
+
+    uint32_t header;
+    ssize_t n = receive_all(socket_fd, (char *) &header, FRAME_HEADER_LEN);
+    if (n <= 0) {
+        return n;
+    }
+
+    size_t len = ntohl(header);
+    if (len > FRAME_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    size_t kept = len < BUFFER_LEN - 1 ? len : BUFFER_LEN - 1;
+    n = receive_all(socket_fd, message, kept);
+    if (n < 0 || (n == 0 && kept > 0)) {
+        return n;
+    }
+
+    // Discards whatever does not fit in the message array.
+    char discard[BUFFER_LEN];
+    for (size_t left = len - kept; left > 0;) {
+        size_t chunk = left < sizeof(discard) ? left : sizeof(discard);
+        n = receive_all(socket_fd, discard, chunk);
+        if (n <= 0) {
+            return n;
+        }
+        left -= chunk;
+    }
+
+    return kept;
+}
+
+/**
+ * Creates a frame holding the given payload with a reference count of one.
+ * The header and the payload are stored contiguously so that a frame is always one iovec.
+ *
+ * @param payload the payload of the frame
+ * @param len the number of characters in the payload
+ * @return the new frame
+ */
+frame_t * frame_create(const char payload[], size_t len) {
+    frame_t *frame = (frame_t *) malloc(sizeof(frame_t) + FRAME_HEADER_LEN + len);
+    uint32_t header = htonl((uint32_t) len);
+
+    frame->refs = 1;
+    frame->len = FRAME_HEADER_LEN + len;
+    frame->data = (char *) (frame + 1);
+    memcpy(frame->data, &header, FRAME_HEADER_LEN);
+    memcpy(frame->data + FRAME_HEADER_LEN, payload, len);
+
+    return frame;
+}
+
+/**
+ * Takes another reference to the frame.
+ *
+ * @param frame the frame
+ * @return the same frame
+ */
+frame_t * frame_retain(frame_t * frame) {
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+/**
+ * Drops a reference to the frame and frees it once none are left.
+ *
+ * @param frame the frame
+ */
+void frame_release(frame_t * frame) {
+    if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(frame);
+    }
+}
+
+/**
+ * Releases the frames whose zerocopy sends the kernel reports as completed.
+ * The caller must hold the outbound mutex.
+ *
+ * @param out the outbound queue
+ * @param socket_fd the socket the frames were sent through
+ */
+static void reap_zerocopy(outbound_t * out, int socket_fd) {
+    while (!out->zc_inflight.empty()) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(socket_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *err = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            // Completions cover the range [ee_info, ee_data]; TCP reports them in order.
+            while (!out->zc_inflight.empty()
+                   && (int32_t) (out->zc_inflight.front().send_id - err->ee_data) <= 0) {
+                frame_release(out->zc_inflight.front().frame);
+                out->zc_inflight.pop_front();
+            }
+        }
+    }
+}
+
+/**
+ * Waits for any flush in progress, then releases every frame the queue holds.
+ * The caller must hold the outbound mutex.
+ *
+ * @param out the outbound queue
+ */
+static void drop_frames(outbound_t * out) {
+    // The flushing thread writes from the frames without the lock, so they must outlive it.
+    while (out->flushing) {
+        pthread_cond_wait(&out->flushed, &out->mutex);
+    }
+
+    for (size_t i = 0; i < out->pending.size(); i++) {
+        frame_release(out->pending[i]);
+    }
+    for (size_t i = 0; i < out->zc_inflight.size(); i++) {
+        frame_release(out->zc_inflight[i].frame);
+    }
+    out->pending.clear();
+    out->zc_inflight.clear();
+    out->offset = 0;
+}
+
+/**
+ * Prepares an outbound queue; called once before the queue is first used.
+ * The same queue may then be attached to one socket after another.
+ *
+ * @param out the outbound queue
+ */
+void outbound_init(outbound_t * out) {
+    pthread_mutex_init(&out->mutex, NULL);
+    pthread_cond_init(&out->flushed, NULL);
+    out->flushing = false;
+    out->zerocopy = false;
+    out->stalled = false;
+    out->offset = 0;
+    out->zc_next_id = 0;
+}
+
+/**
+ * Resets the outbound queue for a newly connected socket,
+ * dropping any frame left over from the previous one.
+ *
+ * @param out the outbound queue
+ * @param socket_fd the socket the queue writes to
+ * @param zerocopy whether to try enabling MSG_ZEROCOPY on the socket
+ */
+void outbound_attach(outbound_t * out, int socket_fd, bool zerocopy) {
+    int one = 1;
+    bool enabled = zerocopy && setsockopt(socket_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#ifdef USE_TLS
+    // SSL_write() copies every byte while encrypting it, so only kTLS can send without copying.
+    enabled = enabled && !tls_needs_write(socket_fd);
+#endif
+
+    pthread_mutex_lock(&out->mutex);
+    drop_frames(out);
+    out->zerocopy = enabled;
+    out->stalled = false;
+    out->offset = 0;
+    out->zc_next_id = 0;
+    pthread_mutex_unlock(&out->mutex);
+}
+
+/**
+ * Queues the frame by reference on the outbound queue.
+ *
+ * @param out the outbound queue
+ * @param frame the frame to queue; the queue takes its own reference
+ */
+void outbound_push(outbound_t * out, frame_t * frame) {
+    pthread_mutex_lock(&out->mutex);
+    out->pending.push_back(frame_retain(frame));
+    pthread_mutex_unlock(&out->mutex);
+}
+
+/**
+ * Writes every queued frame to the socket, batching them into as few syscalls as possible.
+ * If another thread is already flushing the queue, it will pick up the new frames,
+ * so the call returns immediately. On a non-blocking socket the call stops once the
+ * socket is full and leaves the rest queued.
+ *
+ * @param out the outbound queue
+ * @param socket_fd the socket to write to
+ * @return false if the socket failed
+ */
+bool outbound_flush(outbound_t * out, int socket_fd) {
+    bool ok = true;
+
+    pthread_mutex_lock(&out->mutex);
+    if (out->flushing) {
+        pthread_mutex_unlock(&out->mutex);
+        return true;
+    }
+    out->flushing = true;
+    reap_zerocopy(out, socket_fd);
+
+    while (!out->pending.empty()) {
+        struct iovec iov[FLUSH_MAX_IOV];
+        int count = 0;
+        size_t total = 0;
+
+        for (size_t i = 0; i < out->pending.size() && count < FLUSH_MAX_IOV; i++, count++) {
+            frame_t *frame = out->pending[i];
+            size_t skip = (i == 0) ? out->offset : 0;
+            iov[count].iov_base = frame->data + skip;
+            iov[count].iov_len = frame->len - skip;
+            total += iov[count].iov_len;
+        }
+
+        // Only the flushing thread pops frames, so the iovecs stay valid without the lock.
+        bool use_zerocopy = out->zerocopy && total >= ZEROCOPY_THRESHOLD;
+        pthread_mutex_unlock(&out->mutex);
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        bool zerocopy_unsupported = false;
+        ssize_t sent = socket_send(socket_fd, &msg, MSG_NOSIGNAL | (use_zerocopy ? MSG_ZEROCOPY : 0));
+        if (sent < 0 && use_zerocopy && (errno == ENOBUFS || errno == EOPNOTSUPP)) {
+            // The kernel ran out of pinned-page budget, so this batch is copied instead.
+            // A kTLS socket may not support MSG_ZEROCOPY at all, so the queue stops trying.
+            zerocopy_unsupported = (errno == EOPNOTSUPP);
+            use_zerocopy = false;
+            sent = socket_send(socket_fd, &msg, MSG_NOSIGNAL);
+        }
+
+        pthread_mutex_lock(&out->mutex);
+        if (zerocopy_unsupported) {
+            out->zerocopy = false;
+        }
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // A non-blocking socket is full, or a blocking one hit its send timeout;
+            // the caller decides whether to wait for it or to give up on the peer.
+            out->stalled = (errno == EAGAIN || errno == EWOULDBLOCK);
+            ok = out->stalled;
+            break;
+        }
+        out->stalled = false;
+
+        // Pops the frames that were written completely.
+        size_t left = sent;
+        while (left > 0) {
+            frame_t *frame = out->pending.front();
+            size_t remaining = frame->len - out->offset;
+            if (left < remaining) {
+                // The kernel may still read the part just sent after a later copying
+                // send finishes the frame, so this send holds a reference of its own.
+                if (use_zerocopy) {
+                    zc_pending_t entry = {out->zc_next_id, frame_retain(frame)};
+                    out->zc_inflight.push_back(entry);
+                }
+                out->offset += left;
+                break;
+            }
+
+            left -= remaining;
+            out->offset = 0;
+            out->pending.pop_front();
+
+            if (use_zerocopy) {
+                zc_pending_t entry = {out->zc_next_id, frame};
+                out->zc_inflight.push_back(entry);
+            } else {
+                frame_release(frame);
+            }
+        }
+
+        if (use_zerocopy) {
+            out->zc_next_id++;
+        }
+    }
+
+    reap_zerocopy(out, socket_fd);
+    out->flushing = false;
+    pthread_cond_broadcast(&out->flushed);
+    pthread_mutex_unlock(&out->mutex);
+
+    return ok;
+}
+
+/**
+ * Determines if the outbound queue still holds frames that were not fully written.
+ *
+ * @param out the outbound queue
+ * @return true if a flush is still needed
+ */
+bool outbound_has_pending(outbound_t * out) {
+    pthread_mutex_lock(&out->mutex);
+    bool pending = !out->pending.empty();
+    pthread_mutex_unlock(&out->mutex);
+    return pending;
+}
+
+/**
+ * Determines if the last write found the socket full.
+ *
+ * @param out the outbound queue
+ * @return true if the peer is not keeping up
+ */
+bool outbound_is_stalled(outbound_t * out) {
+    pthread_mutex_lock(&out->mutex);
+    bool stalled = out->stalled;
+    pthread_mutex_unlock(&out->mutex);
+    return stalled;
+}
+
+/**
+ * Drops every frame still held by the outbound queue, waiting for any flush
+ * in progress to finish first. Shut the socket down beforehand so that a flush
+ * blocked on a dead peer returns promptly.
+ *
+ * @param out the outbound queue
+ */
+void outbound_clear(outbound_t * out) {
+    pthread_mutex_lock(&out->mutex);
+    drop_frames(out);
+    pthread_mutex_unlock(&out->mutex);
+}
+
+/**
+ * Appends bytes read from the socket to the decoder.
+ *
+ * @param decoder the frame decoder
+ * @param data the bytes read
+ * @param len the number of bytes read
+ */
+void frame_decoder_feed(frame_decoder_t * decoder, const char data[], size_t len) {
+    // Compacts the buffer once most of it has been returned already.
+    if (decoder->consumed > 0 && decoder->consumed * 2 >= decoder->buffer.size()) {
+        decoder->buffer.erase(0, decoder->consumed);
+        decoder->consumed = 0;
+    }
+    decoder->buffer.append(data, len);
+}
+
+/**
+ * Takes the next complete frame payload out of the decoder.
+ *
+ * @param decoder the frame decoder
+ * @param payload a string to store the payload; any data already in it will be erased
+ * @return 1 if a frame was returned, 0 if more bytes are needed,
+ *         or -1 if the stream announces a frame larger than FRAME_MAX_PAYLOAD
+ */
+int frame_decoder_next(frame_decoder_t * decoder, std::string & payload) {
+    size_t available = decoder->buffer.size() - decoder->consumed;
+    if (available < FRAME_HEADER_LEN) {
+        return 0;
+    }
+
+    uint32_t header;
+    memcpy(&header, decoder->buffer.data() + decoder->consumed, FRAME_HEADER_LEN);
+    size_t len = ntohl(header);
+    if (len > FRAME_MAX_PAYLOAD) {
+        return -1;
+    }
+    if (available < FRAME_HEADER_LEN + len) {
+        return 0;
+    }
+
+    payload.assign(decoder->buffer, decoder->consumed + FRAME_HEADER_LEN, len);
+    decoder->consumed += FRAME_HEADER_LEN + len;
+    return 1;
+}
+
+/**
+ * Drops every byte held by the decoder.
+ *
+ * @param decoder the frame decoder
+ */
+void frame_decoder_reset(frame_decoder_t * decoder) {
+    decoder->buffer.clear();
+    decoder->consumed = 0;
+}
+
+#ifdef USE_TLS
+/**
+ * Prints the reason the last TLS call failed.
+ *
+ * @param what what was being done
+ */
+static void tls_print_error(const char what[]) {
+    unsigned long code = ERR_get_error();
+    char reason[256] = "unknown error";
+    if (code != 0) {
+        ERR_error_string_n(code, reason, sizeof(reason));
+    }
+    fprintf(stderr, "TLS: %s failed: %s\n", what, reason);
+    ERR_clear_error();
+}
+
+/**
+ * Applies the settings shared by the server and client contexts.
+ *
+ * @param ctx the context
+ */
+static void tls_configure(SSL_CTX * ctx) {
+    // OpenSSL writes with write() rather than send(MSG_NOSIGNAL), so a peer that went away
+    // would raise SIGPIPE instead of failing the call.
+    signal(SIGPIPE, SIG_IGN);
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // Hands the record layer to the kernel when it can, so sends skip SSL_write().
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    // Lets socket_send() write what it can and pick up from a moved buffer later, and
+    // stops SSL_read() from blocking again after a handshake record with the lock held.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_clear_mode(ctx, SSL_MODE_AUTO_RETRY);
+}
+
+/**
+ * Turns Nagle's algorithm off on a TLS socket. OpenSSL writes a handshake flight as
+ * several records, and Nagle would hold each one after the first until the peer's
+ * delayed ACK. Afterwards every write is a whole record, so nothing is gained by delaying it.
+ *
+ * @param socket_fd the socket
+ */
+static void tls_set_nodelay(int socket_fd) {
+    int on = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/**
+ * Makes the socket use the connection that was just set up on it.
+ *
+ * @param socket_fd the socket
+ * @param ssl the connection
+ */
+static void tls_attach(int socket_fd, SSL * ssl) {
+    tls_socket_t *tls = &tls_sockets[socket_fd];
+
+    pthread_mutex_lock(&tls->mutex);
+    tls->kernel_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    __atomic_store_n(&tls->ssl, ssl, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tls->mutex);
+}
+
+/**
+ * Caches a resumable session the server just sent, in memory and in the session file.
+ *
+ * @param session the session; ownership passes to the cache
+ * @return 1, to keep the session
+ */
+static int remember_session(SSL *, SSL_SESSION * session) {
+    pthread_mutex_lock(&client_session_mutex);
+    if (client_session != NULL) {
+        SSL_SESSION_free(client_session);
+    }
+    client_session = session;
+
+    if (client_session_path != NULL) {
+        FILE *file = fopen(client_session_path, "w");
+        if (file != NULL) {
+            PEM_write_SSL_SESSION(file, session);
+            fclose(file);
+        }
+    }
+    pthread_mutex_unlock(&client_session_mutex);
+
+    return 1;
+}
+
+/**
+ * Sets up the server side of TLS.
+ * Session tickets are on, so returning clients resume without a full handshake.
+ *
+ * @param cert_path the PEM file holding the certificate chain
+ * @param key_path the PEM file holding the private key
+ * @return false if the certificate or key could not be loaded
+ */
+bool tls_server_init(const char cert_path[], const char key_path[]) {
+    server_ctx = SSL_CTX_new(TLS_server_method());
+    if (server_ctx == NULL) {
+        tls_print_error("creating the server context");
+        return false;
+    }
+    tls_configure(server_ctx);
+
+    if (SSL_CTX_use_certificate_chain_file(server_ctx, cert_path) != 1) {
+        tls_print_error("loading the certificate");
+        return false;
+    }
+    if (SSL_CTX_use_PrivateKey_file(server_ctx, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(server_ctx) != 1) {
+        tls_print_error("loading the private key");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Sets up the client side of TLS.
+ *
+ * @param ca_path the PEM file of the CAs to trust, or NULL for the system's
+ * @param session_path where to cache the resumable session between runs, or NULL
+ * @return false if the CAs could not be loaded
+ */
+bool tls_client_init(const char ca_path[], const char session_path[]) {
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    if (client_ctx == NULL) {
+        tls_print_error("creating the client context");
+        return false;
+    }
+    tls_configure(client_ctx);
+
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_PEER, NULL);
+    int loaded = (ca_path != NULL) ? SSL_CTX_load_verify_locations(client_ctx, ca_path, NULL)
+                                   : SSL_CTX_set_default_verify_paths(client_ctx);
+    if (loaded != 1) {
+        tls_print_error("loading the trusted CAs");
+        return false;
+    }
+
+    // Sessions are kept by remember_session() instead of OpenSSL's internal cache.
+    SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(client_ctx, remember_session);
+
+    if (session_path != NULL) {
+        client_session_path = strdup(session_path);
+        FILE *file = fopen(session_path, "r");
+        if (file != NULL) {
+            client_session = PEM_read_SSL_SESSION(file, NULL, NULL, NULL);
+            fclose(file);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Drops the cached session, in memory and on the disk, so the next handshake is a full one.
+ */
+void tls_forget_session() {
+    pthread_mutex_lock(&client_session_mutex);
+    if (client_session != NULL) {
+        SSL_SESSION_free(client_session);
+        client_session = NULL;
+    }
+    if (client_session_path != NULL) {
+        unlink(client_session_path);
+    }
+    pthread_mutex_unlock(&client_session_mutex);
+}
+
+/**
+ * Runs the server side of the handshake on a newly accepted blocking socket.
+ * Reads on the socket time out afterwards as well, which bounds how long
+ * a peer that stops in the middle of a record can hold its TLS state.
+ *
+ * @param socket_fd the socket
+ * @return false if the handshake failed
+ */
+bool tls_accept(int socket_fd) {
+    if (server_ctx == NULL || socket_fd >= TLS_MAX_FD) {
+        return false;
+    }
+
+    struct timeval timeout = {TLS_HANDSHAKE_TIMEOUT, 0};
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    SSL *ssl = SSL_new(server_ctx);
+    tls_set_nodelay(socket_fd);
+    if (ssl == NULL || SSL_set_fd(ssl, socket_fd) != 1 || SSL_accept(ssl) != 1) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        return false;
+    }
+
+    tls_attach(socket_fd, ssl);
+    return true;
+}
+
+/**
+ * Runs the client side of the handshake on a connected socket,
+ * resuming the cached session if the server still accepts it.
+ * A non-blocking socket is switched to blocking for the handshake.
+ *
+ * @param socket_fd the socket
+ * @param host_ip the IP address the server's certificate must be issued for
+ * @param resumed set to whether the session was resumed
+ * @return false if the handshake failed
+ */
+bool tls_connect(int socket_fd, const char host_ip[], bool * resumed) {
+    if (client_ctx == NULL || socket_fd >= TLS_MAX_FD) {
+        return false;
+    }
+
+    SSL *ssl = SSL_new(client_ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, socket_fd) != 1 ||
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host_ip) != 1) {
+        tls_print_error("setting up the connection");
+        SSL_free(ssl);
+        return false;
+    }
+
+    pthread_mutex_lock(&client_session_mutex);
+    if (client_session != NULL) {
+        SSL_set_session(ssl, client_session);
+    }
+    pthread_mutex_unlock(&client_session_mutex);
+
+    int flags = fcntl(socket_fd, F_GETFL);
+    fcntl(socket_fd, F_SETFL, flags & ~O_NONBLOCK);
+    struct timeval timeout = {TLS_HANDSHAKE_TIMEOUT, 0};
+    struct timeval no_timeout = {0, 0};
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    tls_set_nodelay(socket_fd);
+    int result = SSL_connect(ssl);
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+    fcntl(socket_fd, F_SETFL, flags);
+
+    if (result != 1) {
+        tls_print_error("handshake");
+        SSL_free(ssl);
+        return false;
+    }
+
+    *resumed = SSL_session_reused(ssl);
+    tls_attach(socket_fd, ssl);
+    return true;
+}
+
+/**
+ * Determines if kTLS encrypts what is sent on the socket.
+ *
+ * @param socket_fd the socket
+ * @return true if the socket uses TLS and the kernel does its encryption
+ */
+bool tls_kernel_send(int socket_fd) {
+    tls_socket_t *tls = tls_lock(socket_fd);
+    if (tls == NULL) {
+        return false;
+    }
+    bool kernel_send = tls->kernel_send;
+    pthread_mutex_unlock(&tls->mutex);
+    return kernel_send;
+}
+
+/**
+ * Ends TLS on the socket and frees its state; called before the socket is closed.
+ * Does nothing if the socket does not use TLS.
+ *
+ * @param socket_fd the socket
+ */
+void tls_close(int socket_fd) {
+    tls_socket_t *tls = tls_lock(socket_fd);
+    if (tls == NULL) {
+        return;
+    }
+
+    SSL *ssl = tls->ssl;
+    __atomic_store_n(&tls->ssl, (SSL *) NULL, __ATOMIC_RELEASE);
+    tls->kernel_send = false;
+    pthread_mutex_unlock(&tls->mutex);
+
+    // Sends close_notify without waiting for the peer's.
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    ERR_clear_error();
 }
+#endif
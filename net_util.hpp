@@ -14,16 +14,146 @@
 #ifndef PROJECT_NETWORK_H
 #define PROJECT_NETWORK_H
 
+#include <stdint.h>
+#include <pthread.h>
 #include <sys/socket.h>
 
+#include <deque>
+#include <string>
+
+#ifdef USE_TLS
+#include <openssl/ssl.h>
+#endif
+
 #define DEFAULT_HOST_IP "127.0.0.1"
 #define DEFAULT_PORT 7000
 #define BUFFER_LEN 1024
 
+// Every frame on the wire is a 4-byte big-endian payload length followed by the payload.
+#define FRAME_HEADER_LEN 4
+#define FRAME_MAX_PAYLOAD (16 * 1024 * 1024)
+
+// Maximum number of frames written by a single writev()/sendmsg() call.
+#define FLUSH_MAX_IOV 64
+
+// Batches at least this large are sent with MSG_ZEROCOPY when it is enabled.
+#define ZEROCOPY_THRESHOLD (16 * 1024)
+
+// An immutable, reference-counted frame (header + payload) built once
+// and shared by every outbound queue it is pushed onto.
+typedef struct frame_struct {
+    int refs;
+    size_t len;
+    char *data;
+} frame_t;
+
+// A frame that has been handed to the kernel with MSG_ZEROCOPY
+// and must stay alive until the matching completion is reported.
+typedef struct zc_pending_struct {
+    uint32_t send_id;
+    frame_t *frame;
+} zc_pending_t;
+
+// The outbound path of one socket.
+// Frames are queued by reference and flushed together with one syscall.
+typedef struct outbound_struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t flushed;                 // Signaled when a thread stops draining the queue.
+    bool flushing;                          // Set while some thread is draining the queue.
+    bool zerocopy;                          // Set if SO_ZEROCOPY was enabled on the socket.
+    bool stalled;                           // Set if the last write found the socket full.
+    size_t offset;                          // Bytes of the front frame already written.
+    uint32_t zc_next_id;                    // The ID the kernel gives the next zerocopy send.
+    std::deque<frame_t *> pending;          // Frames not yet fully written.
+    std::deque<zc_pending_t> zc_inflight;   // Frames waiting for a zerocopy completion.
+} outbound_t;
+
+#ifdef USE_TLS
+// Sockets with a descriptor at least this large cannot use TLS.
+#define TLS_MAX_FD 16384
+
+// The most plaintext one TLS record carries.
+#define TLS_RECORD_LEN ((size_t) 16384)
+
+// Seconds a TLS handshake, or a record that has started arriving, may take.
+#define TLS_HANDSHAKE_TIMEOUT 10
+#endif
+
+// Splits a byte stream read from a non-blocking socket back into frame payloads.
+typedef struct frame_decoder_struct {
+    std::string buffer;     // Bytes received but not yet returned as frames.
+    size_t consumed;        // Bytes at the front of the buffer already returned.
+} frame_decoder_t;
+
 // Sends the message through socket.
 ssize_t send_message(int socket_fd, const char message[]);
 
 // Receives the message through socket.
 ssize_t receive_message(int socket_fd, char message[]);
 
+// Receives whatever bytes are available on the socket, decrypting them if it uses TLS.
+ssize_t socket_receive(int socket_fd, char buffer[], size_t len);
+
+// Creates a frame holding the given payload with a reference count of one.
+frame_t * frame_create(const char payload[], size_t len);
+
+// Takes another reference to the frame.
+frame_t * frame_retain(frame_t * frame);
+
+// Drops a reference to the frame and frees it once none are left.
+void frame_release(frame_t * frame);
+
+// Prepares an outbound queue; called once before the queue is first used.
+void outbound_init(outbound_t * out);
+
+// Resets the outbound queue for a newly connected socket.
+void outbound_attach(outbound_t * out, int socket_fd, bool zerocopy);
+
+// Queues the frame by reference on the outbound queue.
+void outbound_push(outbound_t * out, frame_t * frame);
+
+// Writes every queued frame to the socket, batching them into as few syscalls as possible.
+bool outbound_flush(outbound_t * out, int socket_fd);
+
+// Determines if the outbound queue still holds frames that were not fully written.
+bool outbound_has_pending(outbound_t * out);
+
+// Determines if the last write found the socket full.
+bool outbound_is_stalled(outbound_t * out);
+
+// Drops every frame still held by the outbound queue.
+void outbound_clear(outbound_t * out);
+
+// Appends bytes read from the socket to the decoder.
+void frame_decoder_feed(frame_decoder_t * decoder, const char data[], size_t len);
+
+// Takes the next complete frame payload out of the decoder.
+int frame_decoder_next(frame_decoder_t * decoder, std::string & payload);
+
+// Drops every byte held by the decoder.
+void frame_decoder_reset(frame_decoder_t * decoder);
+
+#ifdef USE_TLS
+// Sets up the server side of TLS with the given certificate chain and private key.
+bool tls_server_init(const char cert_path[], const char key_path[]);
+
+// Sets up the client side of TLS, trusting the given CAs and caching sessions in the given file.
+bool tls_client_init(const char ca_path[], const char session_path[]);
+
+// Drops the cached session so the next handshake is a full one.
+void tls_forget_session();
+
+// Runs the server side of the handshake on a newly accepted socket.
+bool tls_accept(int socket_fd);
+
+// Runs the client side of the handshake on a connected socket, resuming the cached session if possible.
+bool tls_connect(int socket_fd, const char host_ip[], bool * resumed);
+
+// Determines if kTLS encrypts what is sent on the socket.
+bool tls_kernel_send(int socket_fd);
+
+// Ends TLS on the socket and frees its state; called before the socket is closed.
+void tls_close(int socket_fd);
+#endif
+
 #endif //PROJECT_NETWORK_H
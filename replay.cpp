@@ -0,0 +1,632 @@
+/*
+ ***************************************************************************
+ * Clarkson University                                                     *
+ * CS 444/544: Operating Systems, Spring 2024                              *
+ * Project: Prototyping a Web Server/Browser                               *
+ * Created by Daqing Hou, dhou@clarkson.edu                                *
+ *            Xinchao Song, xisong@clarkson.edu                            *
+ * April 10, 2022                                                          *
+ * Copyright © 2022-2024 CS 444/544 Instructor Team. All rights reserved.  *
+ * Unauthorized use is strictly prohibited.                                *
+ ***************************************************************************
+ */
+
+#include "net_util.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+// File System
+#include <fstream>
+
+// Connections and Sessions
+#include <map>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+#define TRACE_HEADER "# session trace v1"
+#define RESPONSE_TIMEOUT_MS 10000   // How long a command may go unanswered before the replay gives up.
+#define POLL_INTERVAL_MS 100        // The longest a wait for the next event sleeps at once.
+#define READ_LEN 65536              // Bytes read from a connection at once.
+
+// One line of a trace.
+typedef struct trace_event_struct {
+    long long time_us;      // Microseconds since the recording started.
+    int connection;         // The connection's number in the trace; -1 for STATE.
+    std::string event;      // CONNECT, ASSIGN, CMD, DISCONNECT or STATE.
+    std::string payload;
+} trace_event_t;
+
+// A connection of the recording, replayed as a connection to the server under test.
+typedef struct replay_connection_struct {
+    int socket_fd;                  // -1 once the connection is closed.
+    frame_decoder_t decoder;        // Bytes from the server not yet split into frames.
+    std::string registration_reply; // The server's answer to the registration.
+    bool subscribing;               // Set after a "SUB" until its ASSIGN event is replayed.
+    int last_tag;                   // The session of the last tagged frame received.
+    std::string last_body;          // The last frame received, without its tag.
+    int pending_pongs;              // PONGs owed for the PINGs that follow every command.
+} replay_connection_t;
+
+static std::map<int, replay_connection_t> connections;     // The replayed connections, by trace number.
+static std::map<int, int> session_map;                      // Maps recorded session IDs to replayed ones.
+static std::map<int, std::string> expected_states;          // The final state of each recorded session.
+static std::vector<long long> latencies_us;                 // The latency of every replayed command.
+static struct sockaddr_in server_addr;                      // The address of the server under test.
+static double speed = 1.0;                                  // How many times faster than recorded to replay; 0 for no waiting.
+static int num_errors = 0;                                  // Commands the server answered with "ERROR".
+static int num_skipped = 0;                                 // Events of connections that could not be opened.
+
+// Returns the time of a monotonic clock in microseconds.
+long long now_us();
+
+// Reads every event of a trace.
+bool load_trace(const char path[], std::vector<trace_event_t> & events);
+
+// Returns the replayed ID for a recorded session ID.
+int map_session(int session_id);
+
+// Rewrites the session IDs of a registration message.
+std::string rewrite_registration(const std::string & registration);
+
+// Rewrites the session IDs of a command.
+std::string rewrite_command(const std::string & command, bool * subscribing);
+
+// Handles one frame received on a connection.
+void handle_frame(replay_connection_t & connection, const std::string & frame);
+
+// Reads every frame the server has sent on any connection, waiting at most the given time.
+void pump(int timeout_ms);
+
+// Opens a connection and registers it like the recorded one.
+bool open_connection(int id, const std::string & registration);
+
+// Maps the sessions the recorded server assigned to the ones the server under test assigned.
+void handle_assign(replay_connection_t & connection, const std::string & payload);
+
+// Sends a command and waits until the server has handled it.
+bool send_command(replay_connection_t & connection, const std::string & command, bool record_latency);
+
+// Closes a connection.
+void close_connection(replay_connection_t & connection);
+
+// Replays every event of the trace.
+void replay(const std::vector<trace_event_t> & events);
+
+// Compares the final state of every recorded session with the server's.
+int compare_states();
+
+// Prints the throughput and latency distribution.
+void print_report(long long elapsed_us);
+
+/**
+ * Returns the time of a monotonic clock in microseconds.
+ *
+ * @return the current time
+ */
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Reads every event of a trace written by "server --record".
+ *
+ * @param path the path of the trace
+ * @param events a vector to store the events
+ * @return false if the file is not a trace
+ */
+bool load_trace(const char path[], std::vector<trace_event_t> & events) {
+    std::ifstream trace_file(path);
+    std::string line;
+
+    if (!std::getline(trace_file, line) || line != TRACE_HEADER) {
+        return false;
+    }
+
+    while (std::getline(trace_file, line)) {
+        trace_event_t event;
+        char name[16];
+        int length;
+
+        if (sscanf(line.c_str(), "%lld %d %15s%n", &event.time_us, &event.connection, name, &length) != 3) {
+            return false;
+        }
+        event.event = name;
+
+        // Undoes the escaping of newlines and backslashes.
+        for (size_t i = length + (line.size() > (size_t) length ? 1 : 0); i < line.size(); i++) {
+            if (line[i] == '\\' && i + 1 < line.size()) {
+                event.payload += line[++i] == 'n' ? '\n' : line[i];
+            } else {
+                event.payload += line[i];
+            }
+        }
+        events.push_back(event);
+    }
+
+    return true;
+}
+
+/**
+ * Returns the replayed ID for a recorded session ID. A session the trace never saw being
+ * created existed before the recording, so it keeps its ID.
+ *
+ * @param session_id the recorded session ID; -1 asks for a new session
+ * @return the session ID to use against the server under test
+ */
+int map_session(int session_id) {
+    if (session_id == -1) {
+        return -1;
+    }
+
+    std::map<int, int>::iterator it = session_map.find(session_id);
+    if (it == session_map.end()) {
+        session_map[session_id] = session_id;
+        return session_id;
+    }
+
+    return it->second;
+}
+
+/**
+ * Rewrites the session IDs of a registration message, "<id>" or "MUX <id> <id> ...".
+ *
+ * @param registration the recorded registration
+ * @return the registration to send
+ */
+std::string rewrite_registration(const std::string & registration) {
+    if (registration.compare(0, 3, "MUX") != 0) {
+        return std::to_string(map_session(strtol(registration.c_str(), NULL, 10)));
+    }
+
+    std::istringstream ids(registration.substr(3));
+    std::string result = "MUX";
+    int id;
+    while (ids >> id) {
+        result += " " + std::to_string(map_session(id));
+    }
+
+    return result;
+}
+
+/**
+ * Rewrites the session IDs of a command: the "@<id>" tag of a multiplexed command,
+ * and the argument of "SUB" and "UNSUB".
+ *
+ * @param command the recorded command
+ * @param subscribing set to true if the command is a "SUB"
+ * @return the command to send
+ */
+std::string rewrite_command(const std::string & command, bool * subscribing) {
+    std::string result;
+    const char *rest = command.c_str();
+    char *end;
+
+    *subscribing = false;
+    if (rest[0] == '@') {
+        int session_id = strtol(rest + 1, &end, 10);
+        result = "@" + std::to_string(map_session(session_id));
+        rest = end;
+        while (*rest == ' ') {
+            result += *rest++;
+        }
+    }
+
+    if (strncmp(rest, "SUB ", 4) == 0) {
+        *subscribing = true;
+        return result + "SUB " + std::to_string(map_session(strtol(rest + 4, NULL, 10)));
+    }
+    if (strncmp(rest, "UNSUB ", 6) == 0) {
+        return result + "UNSUB " + std::to_string(map_session(strtol(rest + 6, NULL, 10)));
+    }
+
+    return result + rest;
+}
+
+/**
+ * Handles one frame received on a connection: counts PONGs and errors, answers the server's
+ * keepalive PINGs, and remembers the last tagged session and body.
+ *
+ * @param connection the connection
+ * @param frame the frame payload
+ */
+void handle_frame(replay_connection_t & connection, const std::string & frame) {
+    if (frame == "PONG") {
+        connection.pending_pongs--;
+        return;
+    }
+    if (frame == "PING") {
+        send_message(connection.socket_fd, "PONG");
+        return;
+    }
+
+    std::string body = frame;
+    if (!frame.empty() && frame[0] == '@') {
+        size_t newline = frame.find('\n');
+        connection.last_tag = strtol(frame.c_str() + 1, NULL, 10);
+        body = newline == std::string::npos ? "" : frame.substr(newline + 1);
+    }
+
+    if (body == "ERROR") {
+        num_errors++;
+    }
+    connection.last_body = body;
+}
+
+/**
+ * Reads every frame the server has sent on any connection, waiting at most the given time for
+ * the first one. Broadcasts are drained from every connection, so that the server never finds
+ * a replayed browser that stopped reading.
+ *
+ * @param timeout_ms the longest wait in milliseconds
+ */
+void pump(int timeout_ms) {
+    std::vector<struct pollfd> fds;
+    std::vector<int> ids;
+
+    for (std::map<int, replay_connection_t>::iterator it = connections.begin(); it != connections.end(); ++it) {
+        if (it->second.socket_fd >= 0) {
+            struct pollfd fd = {it->second.socket_fd, POLLIN, 0};
+            fds.push_back(fd);
+            ids.push_back(it->first);
+        }
+    }
+
+    if (poll(fds.data(), fds.size(), timeout_ms) <= 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (fds[i].revents == 0) {
+            continue;
+        }
+
+        replay_connection_t &connection = connections[ids[i]];
+        char buffer[READ_LEN];
+        ssize_t len;
+        while ((len = recv(connection.socket_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+            frame_decoder_feed(&connection.decoder, buffer, len);
+        }
+
+        std::string frame;
+        while (frame_decoder_next(&connection.decoder, frame) == 1) {
+            handle_frame(connection, frame);
+        }
+
+        if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            close_connection(connection);
+        }
+    }
+}
+
+/**
+ * Opens a connection and registers it like the recorded one.
+ *
+ * @param id the connection's number in the trace
+ * @param registration the recorded registration message
+ * @return false if the server could not be reached
+ */
+bool open_connection(int id, const std::string & registration) {
+    replay_connection_t &connection = connections[id];
+    char reply[BUFFER_LEN];
+
+    connection.socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    connection.subscribing = false;
+    connection.last_tag = -1;
+    connection.pending_pongs = 0;
+    frame_decoder_reset(&connection.decoder);
+
+    if (connect(connection.socket_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0
+        || send_message(connection.socket_fd, rewrite_registration(registration).c_str()) < 0
+        || receive_message(connection.socket_fd, reply) <= 0) {
+        close_connection(connection);
+        return false;
+    }
+
+    connection.registration_reply = reply;
+    return true;
+}
+
+/**
+ * Maps the sessions the recorded server assigned to the ones the server under test assigned.
+ * After a registration both answers list the sessions in the same order. After a "SUB" the
+ * server's reply is the only tagged frame, since commands are replayed one at a time.
+ *
+ * @param connection the connection
+ * @param payload the recorded ASSIGN payload
+ */
+void handle_assign(replay_connection_t & connection, const std::string & payload) {
+    if (connection.subscribing) {
+        session_map[strtol(payload.c_str(), NULL, 10)] = connection.last_tag;
+        connection.subscribing = false;
+        return;
+    }
+
+    std::istringstream recorded(payload.compare(0, 3, "MUX") == 0 ? payload.substr(3) : payload);
+    std::istringstream replayed(connection.registration_reply.compare(0, 3, "MUX") == 0
+                                ? connection.registration_reply.substr(3) : connection.registration_reply);
+    int recorded_id;
+    int replayed_id;
+    while (recorded >> recorded_id && replayed >> replayed_id) {
+        session_map[recorded_id] = replayed_id;
+    }
+}
+
+/**
+ * Sends a command followed by a PING and waits for the PONG. The server handles a connection's
+ * messages in order and writes its replies through one queue, so the PONG arrives only after
+ * every reply and broadcast the command caused.
+ *
+ * @param connection the connection
+ * @param command the command
+ * @param record_latency whether the latency counts towards the report
+ * @return false if the server did not answer in time
+ */
+bool send_command(replay_connection_t & connection, const std::string & command, bool record_latency) {
+    long long start = now_us();
+
+    if (send_message(connection.socket_fd, command.c_str()) < 0 || send_message(connection.socket_fd, "PING") < 0) {
+        close_connection(connection);
+        return false;
+    }
+
+    connection.pending_pongs++;
+    while (connection.pending_pongs > 0 && connection.socket_fd >= 0) {
+        if (now_us() - start > RESPONSE_TIMEOUT_MS * 1000LL) {
+            return false;
+        }
+        pump(POLL_INTERVAL_MS);
+    }
+
+    if (record_latency && connection.pending_pongs == 0) {
+        latencies_us.push_back(now_us() - start);
+    }
+    return connection.pending_pongs == 0;
+}
+
+/**
+ * Closes a connection.
+ *
+ * @param connection the connection
+ */
+void close_connection(replay_connection_t & connection) {
+    if (connection.socket_fd >= 0) {
+        close(connection.socket_fd);
+        connection.socket_fd = -1;
+    }
+}
+
+/**
+ * Replays every event of the trace in the recorded order. Events are due at their recorded
+ * time since the first event, divided by the speed; with no waiting, each one starts as soon as the previous one was
+ * handled. Commands are replayed one at a time, so the server sees them in the recorded order
+ * and the final states are deterministic. The price is that the replay is serial: an event is
+ * never sent before the previous command was answered, so a slow answer delays every later event,
+ * and commands that browsers sent concurrently reach the server one by one.
+ *
+ * @param events the events of the trace
+ */
+void replay(const std::vector<trace_event_t> & events) {
+    long long start = now_us();
+    long long first_us = events.empty() ? 0 : events[0].time_us;
+
+    for (size_t i = 0; i < events.size(); i++) {
+        const trace_event_t &event = events[i];
+
+        if (event.event == "STATE") {
+            std::string::size_type newline = event.payload.find('\n');
+            int session_id = strtol(event.payload.c_str(), NULL, 10);
+            expected_states[session_id] = newline == std::string::npos ? "" : event.payload.substr(newline + 1);
+            continue;
+        }
+
+        // Waits until the event is due, draining broadcasts in the meantime.
+        if (speed > 0) {
+            long long due = start + (long long) ((event.time_us - first_us) / speed);
+            for (long long now = now_us(); now < due; now = now_us()) {
+                pump((int) std::min((due - now + 999) / 1000, (long long) POLL_INTERVAL_MS));
+            }
+        }
+
+        if (event.event == "CONNECT") {
+            if (!open_connection(event.connection, event.payload)) {
+                printf("Connection %d could not be opened.\n", event.connection);
+                num_skipped++;
+            }
+            continue;
+        }
+
+        std::map<int, replay_connection_t>::iterator it = connections.find(event.connection);
+        if (it == connections.end() || it->second.socket_fd < 0) {
+            num_skipped++;
+            continue;
+        }
+        replay_connection_t &connection = it->second;
+
+        if (event.event == "ASSIGN") {
+            handle_assign(connection, event.payload);
+        } else if (event.event == "CMD") {
+            bool subscribing;
+            std::string command = rewrite_command(event.payload, &subscribing);
+            connection.subscribing = subscribing;
+            if (!send_command(connection, command, true)) {
+                printf("Connection %d stopped answering.\n", event.connection);
+                close_connection(connection);
+            }
+        } else if (event.event == "DISCONNECT") {
+            close_connection(connection);
+        }
+    }
+}
+
+/**
+ * Compares the final state of every recorded session with the server's, fetching each one
+ * with "SUB" over a multiplexed connection. Differing variables are listed like a diff.
+ *
+ * @return the number of sessions whose states differ
+ */
+int compare_states() {
+    int num_identical = 0;
+    int num_different = 0;
+
+    if (expected_states.empty()) {
+        puts("final states: the trace has none; was the recording stopped with SIGINT or SIGTERM?");
+        return 0;
+    }
+
+    if (!open_connection(-1, "MUX")) {
+        puts("final states: could not connect to compare them");
+        return (int) expected_states.size();
+    }
+    replay_connection_t &checker = connections[-1];
+
+    for (std::map<int, std::string>::iterator it = expected_states.begin(); it != expected_states.end(); ++it) {
+        // Sessions the replay never touched are not expected to match.
+        if (session_map.find(it->first) == session_map.end()) {
+            continue;
+        }
+
+        int session_id = session_map[it->first];
+        checker.last_body.clear();
+        send_command(checker, "SUB " + std::to_string(session_id), false);
+
+        if (checker.last_body == it->second) {
+            num_identical++;
+            continue;
+        }
+
+        num_different++;
+        printf("session %d (replayed as %d) differs:\n", it->first, session_id);
+
+        std::vector<std::string> expected;
+        std::vector<std::string> actual;
+        std::istringstream expected_lines(it->second);
+        std::istringstream actual_lines(checker.last_body);
+        std::string line;
+        while (std::getline(expected_lines, line)) {
+            expected.push_back(line);
+        }
+        while (std::getline(actual_lines, line)) {
+            actual.push_back(line);
+        }
+        for (size_t i = 0; i < expected.size(); i++) {
+            if (std::find(actual.begin(), actual.end(), expected[i]) == actual.end()) {
+                printf("  - %s\n", expected[i].c_str());
+            }
+        }
+        for (size_t i = 0; i < actual.size(); i++) {
+            if (std::find(expected.begin(), expected.end(), actual[i]) == expected.end()) {
+                printf("  + %s\n", actual[i].c_str());
+            }
+        }
+    }
+
+    close_connection(checker);
+    printf("final states: %d identical, %d different\n", num_identical, num_different);
+    return num_different;
+}
+
+/**
+ * Prints the throughput and the latency distribution of the replayed commands.
+ *
+ * @param elapsed_us the duration of the replay in microseconds
+ */
+void print_report(long long elapsed_us) {
+    std::vector<long long> sorted = latencies_us;
+    std::sort(sorted.begin(), sorted.end());
+
+    printf("replayed %zu commands over %zu connections in %.3f s\n", sorted.size(), connections.size(),
+           elapsed_us / 1e6);
+    printf("throughput: %.1f commands/s\n", elapsed_us > 0 ? sorted.size() / (elapsed_us / 1e6) : 0.0);
+    printf("errors: %d, skipped events: %d\n", num_errors, num_skipped);
+
+    if (sorted.empty()) {
+        return;
+    }
+
+    const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+    printf("latency (us): min %lld", sorted.front());
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        printf("  p%g %lld", percentiles[i] * 100, sorted[(size_t) (percentiles[i] * (sorted.size() - 1))]);
+    }
+    printf("  max %lld\n", sorted.back());
+}
+
+/**
+ * The main function for the replay tool.
+ * "replay <trace> [-h <host>] [-p <port>] [--speed original|max|<factor>]"
+ *
+ * @param argc the number of command-line arguments passed by the user
+ * @param argv the array that contains all the arguments
+ * @return exit code; EXIT_FAILURE if the final states differ
+ */
+int main(int argc, char *argv[]) {
+    const char *host_ip = DEFAULT_HOST_IP;
+    const char *trace_path = NULL;
+    int port = DEFAULT_PORT;
+
+    for (int i = 1; i < argc; i++) {
+        if (((strcmp(argv[i], "--host") == 0) || (strcmp(argv[i], "-h") == 0)) && (i + 1 < argc)) {
+            host_ip = argv[++i];
+
+        } else if (((strcmp(argv[i], "--port") == 0) || (strcmp(argv[i], "-p") == 0)) && (i + 1 < argc)) {
+            port = strtol(argv[++i], NULL, 10);
+
+        } else if ((strcmp(argv[i], "--speed") == 0) && (i + 1 < argc)) {
+            i++;
+            speed = strcmp(argv[i], "max") == 0 ? 0 : strcmp(argv[i], "original") == 0 ? 1 : strtod(argv[i], NULL);
+            if (speed < 0 || (speed == 0 && strcmp(argv[i], "max") != 0)) {
+                puts("Invalid speed.");
+                exit(EXIT_FAILURE);
+            }
+
+        } else if (trace_path == NULL && argv[i][0] != '-') {
+            trace_path = argv[i];
+
+        } else {
+            puts("Invalid arguments.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (trace_path == NULL) {
+        puts("Usage: replay <trace> [-h <host>] [-p <port>] [--speed original|max|<factor>]");
+        puts("Replays the commands one at a time over one connection per recorded browser, waiting for each");
+        puts("to be answered. Recorded gaps are kept, but concurrent commands are sent one by one, so the");
+        puts("replay measures latency without reproducing the load of many browsers at once.");
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<trace_event_t> events;
+    if (!load_trace(trace_path, events)) {
+        printf("%s is not a session trace.\n", trace_path);
+        exit(EXIT_FAILURE);
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(host_ip);
+    server_addr.sin_port = htons(port);
+
+    long long start = now_us();
+    replay(events);
+    long long elapsed = now_us() - start;
+
+    for (std::map<int, replay_connection_t>::iterator it = connections.begin(); it != connections.end(); ++it) {
+        close_connection(it->second);
+    }
+
+    print_report(elapsed);
+    exit(compare_states() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -12,6 +12,8 @@
  */
 
 #include "net_util.hpp"
+#include "symtab.hpp"
+#include "vecmath.hpp"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,15 +22,27 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 // File System
 #include <fstream>
 
 // Unordered Map
 #include <unordered_map>
+#include <map>
+
+// Subscriber Lists
+#include <vector>
+#include <string>
+#include <algorithm>
+
+// Vector Values
+#include <memory>
 
 // Time (For Psuedo-Random Number Seeding)
 #include <ctime>
@@ -36,52 +50,363 @@
 // Testing
 #include <iostream>
 
-#define NUM_VARIABLES 26
+#define NUM_VARIABLES NUM_LETTER_VARIABLES
 #define NUM_SESSIONS 128
 #define NUM_BROWSER 128
 #define DATA_DIR "./sessions"
 #define SESSION_PATH_LEN 128
 // Storage file for sessions
 #define SESSIONS_PATH "./sessions/session.dat"
+// Connection lifecycle
+#define DEFAULT_IDLE_TIMEOUT 60     // Seconds of silence before a browser is reaped.
+#define SEND_TIMEOUT 10             // Seconds a send may block before the browser is dropped.
+#define TCP_KEEPALIVE_IDLE 30       // Seconds of TCP silence before the kernel probes.
+#define TCP_KEEPALIVE_INTERVAL 10   // Seconds between kernel keepalive probes.
+#define TCP_KEEPALIVE_COUNT 3       // Unanswered probes before the kernel drops the peer.
+#define WHEEL_SLOTS 64              // Slots in the timer wheel.
+#define WHEEL_TICK_MS 1000          // Milliseconds covered by one slot.
+// Session history
+#define DEFAULT_HISTORY_LEN 1024    // Mutations kept in memory per session.
+#define DEFAULT_HISTORY_BYTES (64 << 20)    // Bytes of history kept in memory per session, vectors included.
+// Vector variables
+#define MAX_VECTOR_LEN (1 << 20)    // Elements a vector variable may hold.
+#define VALUE_FIXED_MIN (-1e20)     // Values at or below this are shown in scientific notation.
+#define VECTOR_PREVIEW_LEN 8        // Elements of a vector shown in broadcasts.
+// Replication
+#define NUM_REPLICAS 16             // Replicas a primary streams to at once.
+#define REPLICA_RETRY_MS 1000       // Milliseconds a replica waits before reconnecting to its primary.
+#define REPLICA_READ_LEN 65536      // Bytes a replica reads from its primary at once.
+// Trace recording
+#define TRACE_HEADER "# session trace v1"
 
 typedef struct browser_struct {
     bool in_use;
     int socket_fd;
-    int session_id;
+    int session_id;             // The default session; untagged commands apply to it.
+    bool multiplexed;           // Set if the browser registered with "MUX" and tags its traffic.
+    std::vector<int> sessions;  // Every session the browser is subscribed to.
+    outbound_t outbound;        // Frames waiting to be written to the browser.
+    unsigned generation;        // Bumped whenever the slot is reused, so stale timers are ignored.
+    long long last_active_ms;   // When the browser last sent anything.
+    long long last_ping_ms;     // When the server last sent a heartbeat.
+    int connection_id;          // Numbers the connection in the trace; never reused, unlike the slot.
 } browser_t;
 
+// An entry in the timer wheel: check the browser once its slot comes around "rounds" more times.
+typedef struct wheel_timer_struct {
+    int browser_id;
+    unsigned generation;
+    int rounds;
+} wheel_timer_t;
+
+// The elements of a vector variable. Vectors are never modified once built,
+// so sessions, history entries and snapshots share them instead of copying.
+typedef std::shared_ptr<const std::vector<double> > vector_ref_t;
+
+// The value of a variable: a vector if one is set, a scalar otherwise.
+typedef struct value_struct {
+    double scalar;
+    vector_ref_t vector;
+} value_t;
+
+// One mutation of a session: variable went from old_value (if it was set) to new_value (if it is set).
+typedef struct history_entry_struct {
+    long long seq;
+    uint32_t variable;
+    bool had_old;
+    bool has_new;
+    value_t old_value;
+    value_t new_value;
+} history_entry_t;
+
+// The bounded mutation history of a session.
+// The newest entries live in a ring buffer; older ones are spilled to the session's history file.
+typedef struct history_struct {
+    history_entry_t *entries;   // The ring buffer; allocated on the first mutation.
+    size_t head;                // Index of the oldest entry in the ring.
+    size_t count;               // Number of entries in the ring.
+    long long next_seq;         // Sequence number of the next mutation.
+    long long floor_seq;        // States at or after this sequence number can be reconstructed.
+    size_t bytes;               // Memory held by the entries in the ring, counting their vectors.
+    std::vector<history_entry_t> unwritten;  // Pushed out of the ring but not yet in the history file.
+} history_t;
+
+// The single-letter variables live inline so that small sessions keep their compact layout;
+// every other name goes to a per-session symbol table created on first use.
+// Variables holding vectors, whatever their name, live in a separate table, also created on first use.
 typedef struct session_struct {
     bool in_use;
     bool variables[NUM_VARIABLES];
     double values[NUM_VARIABLES];
+    symtab_t *named;
+    std::unordered_map<uint32_t, vector_ref_t> *vectors;
+    history_t history;
+    long long version;          // Counts the changes, so that an older state is never saved over a newer one.
 } session_t;
 
+// The defined variables of a session at some point, keyed by variable ID.
+typedef std::map<uint32_t, value_t> snapshot_t;
+
+// A replica following this server. Every change of a variable is queued on it in order.
+typedef struct replica_struct {
+    bool in_use;
+    int socket_fd;
+    outbound_t outbound;
+} replica_t;
+
+// What a change of a session leaves to do once the session lock is released: everything that
+// may block on a socket or on the disk, or that takes long, like formatting large vectors.
+// It is filled in under the lock, so frames are queued in the order of the changes,
+// and a save only writes if nothing newer was saved first.
+typedef struct session_io_struct {
+    int session_id;
+    long long version;              // The session's version the snapshot was taken at.
+    snapshot_t snapshot;            // The variables to save; vectors are shared, not copied.
+    std::vector<int> subscribers;   // The browsers the broadcast was queued on.
+} session_io_t;
+
 static browser_t browser_list[NUM_BROWSER];                             // Stores the information of all browsers.
 static std::unordered_map<int, session_t> session_list;			// Stores the information of all sessions.
-static pthread_mutex_t browser_list_mutex = PTHREAD_MUTEX_INITIALIZER;  // A mutex lock for the browser list.
+static std::unordered_map<int, std::vector<int> > subscriber_list;     // Maps each session to the browsers subscribed to it.
+static pthread_mutex_t browser_list_mutex = PTHREAD_MUTEX_INITIALIZER;  // A mutex lock for the browser list and subscriber list.
 static pthread_mutex_t session_list_mutex = PTHREAD_MUTEX_INITIALIZER;  // A mutex lock for the session list.
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;          // Orders the writes of session and history files;
+                                                                        // taken before the session lock, never while holding it.
+static std::unordered_map<int, long long> saved_versions;               // The version of each session on the disk; guarded by disk_mutex.
+static size_t history_len = DEFAULT_HISTORY_LEN;                       // Mutations kept in memory per session; 0 disables history.
+static size_t history_bytes = DEFAULT_HISTORY_BYTES;                   // Memory the history of a session may hold.
+static bool zerocopy_enabled = false;                                   // Determines if large batches use MSG_ZEROCOPY.
+static long long idle_timeout_ms = DEFAULT_IDLE_TIMEOUT * 1000;         // Silence before a browser is reaped; 0 disables it.
+static std::vector<wheel_timer_t> timer_wheel[WHEEL_SLOTS];             // The idle timers, hashed by expiry tick.
+static int wheel_cursor = 0;                                            // The slot handled by the next tick.
+static pthread_mutex_t timer_wheel_mutex = PTHREAD_MUTEX_INITIALIZER;   // A mutex lock for the timer wheel.
+static replica_t replica_list[NUM_REPLICAS];                            // The replicas following this server; guarded by the session lock.
+static long long replication_lsn = 0;                                   // Sequence number of the last change of any variable; guarded by the session lock.
+static bool is_replica = false;                                         // Set while the server follows a primary and refuses writes.
+static int replicate_port = 0;                                          // The port replicas connect to; 0 disables it.
+static char primary_host[64];                                           // The address of the primary a replica follows.
+static int primary_port = 0;                                            // The replication port of that primary.
+static volatile int primary_socket_fd = -1;                             // A replica's connection to its primary.
+static volatile sig_atomic_t promotion_requested = 0;                   // Set by SIGUSR1 to promote a replica.
+static frame_decoder_t primary_decoder;                                 // Bytes from the primary not yet split into frames.
+static FILE *trace_file = NULL;                                         // The trace being recorded, if any.
+static long long trace_start_us = 0;                                    // When the recording started.
+static int next_connection_id = 0;                                      // The trace number of the next connection.
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;         // A mutex lock for the trace file.
+static sigset_t trace_signals;                                          // The signals that end a recording.
+static bool tls_enabled = false;                                        // Determines if browsers must connect over TLS.
+
+// Returns the IDs of the given snapshots' variables in display order:
+// the single letters first, then every other name alphabetically.
+std::vector<uint32_t> display_order(const snapshot_t & first, const snapshot_t & second);
+
+// Returns the string format of the given value.
+// There will be always 9 digits in the output string.
+void value_to_str(double value, char result[]);
+
+// Appends the string format of the given vector, showing at most max_elements elements.
+void vector_to_str(const std::vector<double> & vector, size_t max_elements, bool exact, std::string & result);
+
+// Appends the string format of the given variable value.
+void variable_value_to_str(const value_t & value, size_t max_elements, std::string & result);
+
+// Parses a scalar or a "[v, v, ...]" vector.
+bool parse_value(const char str[], const char ** end, value_t * value);
+
+// Determines if two variable values are the same.
+bool values_equal(const value_t & first, const value_t & second);
+
+// Returns the string format of the given variables.
+// There will be always 9 digits in the output string.
+void snapshot_to_str(const snapshot_t & snapshot, size_t max_elements, std::string & result);
+
+// Copies every defined variable of the given session.
+void session_snapshot(int session_id, snapshot_t & snapshot);
 
 // Returns the string format of the given session.
 // There will be always 9 digits in the output string.
-void session_to_str(int session_id, char result[]);
+void session_to_str(int session_id, size_t max_elements, std::string & result);
+
+// Gets the value of a variable of the session if it is set.
+bool get_variable(int session_id, uint32_t variable, value_t * value);
+
+// Sets a variable of the session without recording it in the history.
+void store_variable(int session_id, uint32_t variable, bool defined, const value_t & value);
 
 // Determines if the given string represents a number.
 bool is_str_numeric(const char str[]);
 
+// Gets the value of an operand, which is a number or a variable that is set.
+bool get_operand(int session_id, const char token[], value_t * value);
+
+// Applies "+", "-", "*" or "/" to two scalars, two vectors of the same length, or a vector and a scalar.
+bool apply_operation(char symbol, const value_t & first, const value_t & second, value_t * result);
+
+// Determines if the given name is one of the vector functions.
+bool is_function(const char name[]);
+
+// Applies a vector function to its arguments.
+bool apply_function(int session_id, const char name[], char * arguments[], int num_arguments, value_t * result);
+
+// Sets a variable of the session, interning its name.
+bool assign_variable(int session_id, const char name[], const value_t & value);
+
 // Process the given message and update the given session if it is valid.
 bool process_message(int session_id, const char message[]);
 
-// Broadcasts the given message to all browsers with the same session ID.
-void broadcast(int session_id, const char message[]);
+// Returns the time of a monotonic clock in milliseconds.
+long long now_ms();
+
+// Writes the browser's queued frames,
+// dropping the browser if it stopped reading.
+void flush_browser(int browser_id);
+
+// Gets the path for the history file of the given session.
+void get_history_file_path(int session_id, char path[]);
+
+// Continues the history of a session loaded from the disk.
+void load_history(int session_id);
+
+// Sets a variable of the session and records the change in its history under the given sequence number.
+void install_variable(int session_id, long long seq, uint32_t variable, bool defined, const value_t & value);
+
+// Sets a variable of the session, records the change in its history and streams it to every replica.
+void set_variable(int session_id, uint32_t variable, bool defined, const value_t & value);
+
+// Appends the entries pushed out of the session's ring buffer to its history file.
+void write_spilled_history(int session_id);
+
+// Parses a mutation spilled to the history file.
+bool parse_history_line(const std::string & line, history_entry_t * entry);
+
+// Reverts the newest mutation of the session.
+bool undo_mutation(int session_id);
+
+// Applies an UNDO streamed by the primary.
+void apply_undo(int session_id, long long seq, uint32_t variable, bool defined, const value_t & value);
+
+// Reconstructs the variables of the session as they were right after the given mutation.
+bool session_at(int session_id, long long seq, snapshot_t & snapshot);
+
+// Determines if the given command is one of the history commands.
+bool is_history_command(const char command[]);
+
+// Answers the history commands "UNDO", "AT <seq>" and "DIFF <seq1> <seq2>".
+bool process_history_command(int session_id, const char command[], std::string & response, bool *mutated);
+
+// Runs a browser command against a session: a history command or an assignment.
+bool execute_command(int session_id, const char command[], std::string & response, bool * mutated);
+
+// Sends the given message to a single browser through its outbound queue.
+void send_to_browser(int browser_id, const char message[]);
+
+// Sends the given message about the given session to a single browser,
+// tagging it with the session if the browser is multiplexed.
+void reply_to_browser(int browser_id, int session_id, const char message[]);
+
+// Queues the given message on every browser subscribed to the session, without writing it.
+void queue_broadcast(int session_id, const char message[], std::vector<int> & subscribers);
 
 // Gets the path for the given session.
 void get_session_file_path(int session_id, char path[]);
 
+// Loads the variables of a session from the contents of its file.
+bool load_session_stream(int session_id, std::istream & session_file);
+
 // Loads every session from the disk one by one if it exists.
 void load_all_sessions();
 
-// Saves the given sessions to the disk.
-void save_session(int session_id);
+// Saves the given contents of a session to the disk, unless a newer version is saved already.
+void save_session(int session_id, long long version, const std::string & contents);
+
+// Queues the broadcast of a changed session and takes what must be saved, under the session lock.
+void prepare_session_io(int session_id, const std::string & response, session_io_t & io);
+
+// Writes what a change of a session queued, once the session lock is released.
+void finish_session_io(const session_io_t & io);
+
+// Builds the replication frame that sets, unsets or undoes a change of a variable.
+frame_t * build_change_frame(const char kind[], long long lsn, int session_id, long long seq, uint32_t variable,
+                             bool defined, const value_t & value);
+
+// Streams a change of a variable to every replica.
+void replicate_change(const char kind[], int session_id, long long seq, uint32_t variable, bool defined,
+                      const value_t & value);
+
+// Writes the changes queued on every replica.
+void flush_replicas();
+
+// Queues a snapshot of every session on the replica.
+void send_snapshot(int replica_id);
+
+// Frees the replica's slot and its socket.
+void remove_replica(int replica_id);
+
+// Registers a replica, sends it a snapshot, and streams changes to it until it disconnects.
+void * replica_handler(void * replica_socket_fd);
+
+// Accepts replicas on the replication port.
+void * replication_listener(void * arg);
+
+// Clears every variable and the history of a session before a snapshot replaces them.
+void reset_session(int session_id);
+
+// Frees a session and forgets it, as if it had never been used.
+void discard_session(int session_id);
+
+// Applies one frame of the replication stream.
+bool apply_change(const std::string & payload, bool * in_snapshot, std::vector<session_io_t> & io);
+
+// Follows the primary, applying its stream until the server is promoted.
+void * replication_client(void * arg);
+
+// Promotes a replica to a primary on SIGUSR1.
+void handle_promotion(int);
+
+// Creates a socket listening on the given port.
+int open_listener(int port);
+
+// Returns the time of a monotonic clock in microseconds.
+long long now_us();
+
+// Starts recording a trace of every connection to the given file.
+void open_trace(const char path[]);
+
+// Appends an event of a connection to the trace, if one is being recorded.
+void trace_event(int connection_id, const char event[], const char payload[]);
+
+// Writes the final state of every session to the trace and exits once the server is stopped.
+void * trace_finisher(void * arg);
+
+// Returns the session ID to use for a requested one,
+// creating a new session if -1 is requested.
+int resolve_session(int session_id);
+
+// Subscribes the browser to the session.
+void subscribe_browser(int browser_id, int session_id);
+
+// Unsubscribes the browser from the session.
+void unsubscribe_browser(int browser_id, int session_id);
+
+// Arms a timer that checks the browser after the given delay.
+void schedule_idle_check(int browser_id, unsigned generation, long long delay_ms);
+
+// Pings an idle browser, or reaps it once it has been idle for too long.
+void check_idle_browser(int browser_id, unsigned generation);
+
+// Advances the timer wheel once per tick
+// and checks the browsers whose timers expired.
+void * idle_reaper(void * arg);
+
+// Sets the socket options every browser connection uses:
+// TCP keepalive and a send timeout.
+void configure_browser_socket(int socket_fd);
+
+// Frees the browser's slot, its subscriptions, and its socket.
+void remove_browser(int browser_id);
+
+// Answers a registration the server cannot accept with "ERROR" and frees the browser.
+void refuse_registration(int browser_id);
 
 // Assigns a browser ID to the new browser.
 // Determines the correct session ID for the new browser
@@ -101,29 +426,322 @@ void * browser_handler(void * browser_socket_fd);
 void start_server(int port);
 
 /**
- * Returns the string format of the given session.
+ * Returns the IDs of the given snapshots' variables in display order: the single letters
+ * first, in alphabetical order as before, then every other name alphabetically.
+ *
+ * @param first a snapshot
+ * @param second another snapshot, which may be the same one
+ * @return the IDs of every variable set in either snapshot
+ */
+std::vector<uint32_t> display_order(const snapshot_t & first, const snapshot_t & second) {
+    std::vector<uint32_t> ids;
+    std::vector<std::pair<std::string, uint32_t> > named;
+    const snapshot_t *snapshots[2] = {&first, &second};
+
+    for (int i = 0; i < (&first == &second ? 1 : 2); i++) {
+        for (snapshot_t::const_iterator it = snapshots[i]->begin(); it != snapshots[i]->end(); ++it) {
+            if (i == 1 && first.count(it->first) > 0) {
+                continue;
+            }
+            if (it->first < NUM_VARIABLES) {
+                ids.push_back(it->first);
+            } else {
+                named.push_back(std::make_pair(std::string(variable_name(it->first)), it->first));
+            }
+        }
+    }
+
+    std::sort(ids.begin(), ids.end());
+    std::sort(named.begin(), named.end());
+    for (size_t i = 0; i < named.size(); i++) {
+        ids.push_back(named[i].second);
+    }
+
+    return ids;
+}
+
+/**
+ * Returns the string format of the given value.
+ * There will be always 9 digits in the output string.
+ *
+ * @param value the value
+ * @param result an array of at least 32 characters to store the string format
+ */
+void value_to_str(double value, char result[]) {
+    // Negative values as large as VALUE_FIXED_MIN would not fit in fixed notation.
+    if (value < 1000 && value > VALUE_FIXED_MIN) {
+        sprintf(result, "%.6f", value);
+    } else {
+        sprintf(result, "%.8e", value);
+    }
+}
+
+/**
+ * Appends the string format of the given vector as "[v, v, ...]". A vector longer than
+ * max_elements ends with "... (<length> elements)]" after its first max_elements elements.
+ *
+ * @param vector the vector
+ * @param max_elements the number of elements to show at most
+ * @param exact whether the elements are written with every digit, as in the history file,
+ *              rather than like scalars
+ * @param result a string to append the string format to
+ */
+void vector_to_str(const std::vector<double> & vector, size_t max_elements, bool exact, std::string & result) {
+    size_t shown = std::min(vector.size(), max_elements);
+
+    result += '[';
+    for (size_t i = 0; i < shown; i++) {
+        char element[32];
+        if (exact) {
+            sprintf(element, "%.17g", vector[i]);
+        } else {
+            value_to_str(vector[i], element);
+        }
+
+        if (i > 0) {
+            result += ", ";
+        }
+        result += element;
+    }
+    if (shown < vector.size()) {
+        result += ", ... (" + std::to_string(vector.size()) + " elements)";
+    }
+    result += ']';
+}
+
+/**
+ * Appends the string format of the given variable value.
+ *
+ * @param value the value
+ * @param max_elements the number of elements of a vector to show at most
+ * @param result a string to append the string format to
+ */
+void variable_value_to_str(const value_t & value, size_t max_elements, std::string & result) {
+    if (value.vector) {
+        vector_to_str(*value.vector, max_elements, false, result);
+        return;
+    }
+
+    char scalar[32];
+    value_to_str(value.scalar, scalar);
+    result += scalar;
+}
+
+/**
+ * Parses a scalar, or a vector written as "[v, v, ...]" with at least one element.
+ *
+ * @param str the string to parse; leading spaces are skipped
+ * @param end set to the first character after the value
+ * @param value set to the value
+ * @return false if the string does not start with a value
+ */
+bool parse_value(const char str[], const char ** end, value_t * value) {
+    char *next;
+
+    while (*str == ' ') {
+        str++;
+    }
+
+    value->vector.reset();
+    if (*str != '[') {
+        value->scalar = strtod(str, &next);
+        *end = next;
+        return next != str;
+    }
+
+    std::shared_ptr<std::vector<double> > elements = std::make_shared<std::vector<double> >();
+    str++;
+    while (true) {
+        double element = strtod(str, &next);
+        if (next == str || elements->size() == MAX_VECTOR_LEN) {
+            return false;
+        }
+        elements->push_back(element);
+
+        str = next;
+        while (*str == ' ') {
+            str++;
+        }
+        if (*str == ']') {
+            break;
+        }
+        if (*str != ',') {
+            return false;
+        }
+        str++;
+    }
+
+    *end = str + 1;
+    value->scalar = 0.0;
+    value->vector = elements;
+    return true;
+}
+
+/**
+ * Determines if two variable values are the same. Vectors are compared element by element.
+ *
+ * @param first a value
+ * @param second another value
+ * @return true if both are the same scalar or vectors with the same elements
+ */
+bool values_equal(const value_t & first, const value_t & second) {
+    if (first.vector && second.vector) {
+        return first.vector == second.vector || *first.vector == *second.vector;
+    }
+    return !first.vector && !second.vector && first.scalar == second.scalar;
+}
+
+/**
+ * Returns the string format of the given variables, one "<name> = <value>" line each.
  * There will be always 9 digits in the output string.
  *
+ * @param snapshot the variables
+ * @param max_elements the number of elements of each vector to show at most
+ * @param result a string to store the string format of the variables;
+ *               any data already in the string will be erased
+ */
+void snapshot_to_str(const snapshot_t & snapshot, size_t max_elements, std::string & result) {
+    std::vector<uint32_t> ids = display_order(snapshot, snapshot);
+
+    result.clear();
+    for (size_t i = 0; i < ids.size(); i++) {
+        result += variable_name(ids[i]);
+        result += " = ";
+        variable_value_to_str(snapshot.find(ids[i])->second, max_elements, result);
+        result += '\n';
+    }
+}
+
+/**
+ * Copies every defined variable of the given session.
+ *
  * @param session_id the session ID
- * @param result an array to store the string format of the given session;
- *               any data already in the array will be erased
+ * @param snapshot a map to store the variables; any data already in it will be erased
  */
-void session_to_str(int session_id, char result[]) {
-    memset(result, 0, BUFFER_LEN);
-    session_t session = session_list[session_id];
+void session_snapshot(int session_id, snapshot_t & snapshot) {
+    session_t &session = session_list[session_id];
 
+    snapshot.clear();
     for (int i = 0; i < NUM_VARIABLES; i++) {
         if (session.variables[i]) {
-            char line[32];
+            snapshot[i].scalar = session.values[i];
+        }
+    }
 
-            if (session.values[i] < 1000) {
-                sprintf(line, "%c = %.6f\n", 'a' + i, session.values[i]);
-            } else {
-                sprintf(line, "%c = %.8e\n", 'a' + i, session.values[i]);
+    if (session.named != NULL) {
+        for (uint32_t i = 0; i < session.named->capacity; i++) {
+            symbol_slot_t &slot = session.named->slots[i];
+            if (slot.id != NO_VARIABLE && slot.defined) {
+                snapshot[slot.id].scalar = slot.value;
             }
+        }
+    }
+
+    if (session.vectors != NULL) {
+        std::unordered_map<uint32_t, vector_ref_t>::const_iterator it;
+        for (it = session.vectors->begin(); it != session.vectors->end(); ++it) {
+            snapshot[it->first].vector = it->second;
+        }
+    }
+}
+
+/**
+ * Returns the string format of the given session.
+ * There will be always 9 digits in the output string.
+ *
+ * @param session_id the session ID
+ * @param max_elements the number of elements of each vector to show at most;
+ *                     MAX_VECTOR_LEN shows every element
+ * @param result a string to store the string format of the given session;
+ *               any data already in the string will be erased
+ */
+void session_to_str(int session_id, size_t max_elements, std::string & result) {
+    snapshot_t snapshot;
+    session_snapshot(session_id, snapshot);
+    snapshot_to_str(snapshot, max_elements, result);
+}
+
+/**
+ * Gets the value of a variable of the session if it is set.
+ * Single letters are read straight from the inline arrays; other names probe the symbol table.
+ * Vectors are looked up first, since a variable holding one is unset in the scalar storage.
+ *
+ * @param session_id the session ID
+ * @param variable the variable ID
+ * @param value set to the value of the variable
+ * @return false if the variable is not set
+ */
+bool get_variable(int session_id, uint32_t variable, value_t * value) {
+    session_t &session = session_list[session_id];
+
+    value->vector.reset();
+    if (session.vectors != NULL) {
+        std::unordered_map<uint32_t, vector_ref_t>::iterator it = session.vectors->find(variable);
+        if (it != session.vectors->end()) {
+            value->scalar = 0.0;
+            value->vector = it->second;
+            return true;
+        }
+    }
+
+    if (variable < NUM_VARIABLES) {
+        value->scalar = session.values[variable];
+        return session.variables[variable];
+    }
+
+    if (variable == NO_VARIABLE || session.named == NULL) {
+        return false;
+    }
+
+    symbol_slot_t *slot = symtab_find(session.named, variable);
+    if (slot == NULL || !slot->defined) {
+        return false;
+    }
+
+    value->scalar = slot->value;
+    return true;
+}
+
+/**
+ * Sets a variable of the session without recording it in the history or streaming it to replicas.
+ * A vector goes to the session's vector table and unsets the scalar, and the other way around.
+ *
+ * @param session_id the session ID
+ * @param variable the variable ID
+ * @param defined whether the variable is set afterwards
+ * @param value the new value of the variable
+ */
+void store_variable(int session_id, uint32_t variable, bool defined, const value_t & value) {
+    session_t &session = session_list[session_id];
+    bool is_vector = defined && value.vector;
+    bool is_scalar = defined && !value.vector;
+
+    if (is_vector) {
+        if (session.vectors == NULL) {
+            session.vectors = new std::unordered_map<uint32_t, vector_ref_t>();
+        }
+        (*session.vectors)[variable] = value.vector;
+    } else if (session.vectors != NULL) {
+        session.vectors->erase(variable);
+    }
+
+    if (variable < NUM_VARIABLES) {
+        session.variables[variable] = is_scalar;
+        session.values[variable] = is_scalar ? value.scalar : 0.0;
+        return;
+    }
 
-            strcat(result, line);
+    if (session.named == NULL) {
+        if (!is_scalar) {
+            return;
         }
+        session.named = symtab_create();
+    }
+
+    symbol_slot_t *slot = is_scalar ? symtab_insert(session.named, variable) : symtab_find(session.named, variable);
+    if (slot != NULL) {
+        slot->defined = is_scalar;
+        slot->value = is_scalar ? value.scalar : 0.0;
     }
 }
 
@@ -154,296 +772,2007 @@ bool is_str_numeric(const char str[]) {
 }
 
 /**
- * Process the given message and update the given session if it is valid.
- * If the message is valid, the function will return true; otherwise, it will return false.
+ * Gets the value of an operand, which is a number or a variable that is set.
  *
  * @param session_id the session ID
- * @param message the message to be processed
- * @return a boolean that determines if the given message is valid
+ * @param token the operand
+ * @param value set to the value of the operand
+ * @return false if the operand is neither
  */
-bool process_message(int session_id, const char message[]) {
-	// Would prefer a full rewrite of this function to make only one acceptable path to return true, and otherwise instantly return false.
-    char *token;
-    int result_idx;
-    double first_value;
-    char symbol;
-    double second_value;
+bool get_operand(int session_id, const char token[], value_t * value) {
+    if (is_str_numeric(token)) {
+        value->scalar = strtod(token, NULL);
+        value->vector.reset();
+        return true;
+    }
 
-    // Makes a copy of the string since strtok() will modify the string that it is processing.
-    char data[BUFFER_LEN];
-    strcpy(data, message);
+    return get_variable(session_id, lookup_name(token), value);
+}
 
-    // Processes the result variable.
-    token = strtok(data, " ");
-	if (!token) {
-		return false;
-	}
-    result_idx = token[0] - 'a';
+/**
+ * Applies "+", "-", "*" or "/" to two operands. Two scalars give a scalar as before. Two vectors
+ * of the same length are combined element by element, and a scalar is applied to every element
+ * of a vector. Vectors go through the kernels picked for this CPU.
+ *
+ * @param symbol the operation symbol
+ * @param first the first operand
+ * @param second the second operand
+ * @param result set to the result
+ * @return false if the operands are vectors of different lengths
+ */
+bool apply_operation(char symbol, const value_t & first, const value_t & second, value_t * result) {
+    int op = symbol == '+' ? VEC_ADD : symbol == '-' ? VEC_SUB : symbol == '*' ? VEC_MUL : VEC_DIV;
+
+    result->scalar = 0.0;
+    result->vector.reset();
+
+    if (!first.vector && !second.vector) {
+        if (symbol == '+') {
+            result->scalar = first.scalar + second.scalar;
+        } else if (symbol == '-') {
+            result->scalar = first.scalar - second.scalar;
+        } else if (symbol == '*') {
+            result->scalar = first.scalar * second.scalar;
+        } else if (symbol == '/') {
+            result->scalar = first.scalar / second.scalar;
+        }
+        return true;
+    }
 
-	if (result_idx < 0 || result_idx > 25) {
-		return false;
-	}
+    size_t n = first.vector ? first.vector->size() : second.vector->size();
+    if (first.vector && second.vector && second.vector->size() != n) {
+        return false;
+    }
 
-    // Processes "=".
-    token = strtok(NULL, " ");
+    const vec_kernels_t *kernels = vec_kernels();
+    std::shared_ptr<std::vector<double> > elements = std::make_shared<std::vector<double> >(n);
+    if (first.vector && second.vector) {
+        kernels->binary[op](first.vector->data(), second.vector->data(), elements->data(), n);
+    } else if (first.vector) {
+        kernels->binary_scalar[op](first.vector->data(), second.scalar, elements->data(), n);
+    } else {
+        kernels->scalar_binary[op](first.scalar, second.vector->data(), elements->data(), n);
+    }
 
-	if (!token || token[0] != '=') {
-		return false;
-	}
+    result->vector = elements;
+    return true;
+}
 
-    // Processes the first variable/value.
-    token = strtok(NULL, " ");
-	if (!token) {
-		return false;
-	}
-    if (is_str_numeric(token)) {
-        first_value = strtod(token, NULL);
-    } else {
-        int first_idx = token[0] - 'a';
-	if (first_idx < 0 || first_idx > 25 || !session_list[session_id].variables[first_idx]) {
-		return false;
-	}
-        first_value = session_list[session_id].values[first_idx];
+/**
+ * Determines if the given name is one of the vector functions.
+ *
+ * @param name the name
+ * @return true for "iota", "fill", "sum", "min", "max", "len" and "dot"
+ */
+bool is_function(const char name[]) {
+    static const char *functions[] = {"iota", "fill", "sum", "min", "max", "len", "dot"};
+
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        if (strcmp(name, functions[i]) == 0) {
+            return true;
+        }
     }
 
-    // Processes the operation symbol.
-    token = strtok(NULL, " ");
-    if (token == NULL) {
-        session_list[session_id].variables[result_idx] = true;
-        session_list[session_id].values[result_idx] = first_value;
-        return true;
+    return false;
+}
+
+/**
+ * Applies a vector function to its arguments. "iota <n>" builds the vector [0, 1, ..., n - 1]
+ * and "fill <n> <v>" a vector of n copies of v. "sum", "min", "max" and "len" reduce one vector
+ * to a scalar, and "dot" multiplies two vectors of the same length.
+ *
+ * @param session_id the session ID
+ * @param name the function name
+ * @param arguments the arguments, each a number or a variable
+ * @param num_arguments the number of arguments
+ * @param result set to the result
+ * @return false if the arguments do not fit the function
+ */
+bool apply_function(int session_id, const char name[], char * arguments[], int num_arguments, value_t * result) {
+    const vec_kernels_t *kernels = vec_kernels();
+    value_t first;
+    value_t second;
+
+    result->scalar = 0.0;
+    result->vector.reset();
+
+    if (strcmp(name, "iota") == 0 || strcmp(name, "fill") == 0) {
+        bool fill = name[0] == 'f';
+        if (num_arguments != (fill ? 2 : 1) || !get_operand(session_id, arguments[0], &first) || first.vector) {
+            return false;
+        }
+        if (fill && (!get_operand(session_id, arguments[1], &second) || second.vector)) {
+            return false;
+        }
+        if (!(first.scalar >= 1 && first.scalar <= MAX_VECTOR_LEN)) {
+            return false;
+        }
+
+        size_t n = (size_t) first.scalar;
+        std::shared_ptr<std::vector<double> > elements =
+            std::make_shared<std::vector<double> >(n, fill ? second.scalar : 0.0);
+        for (size_t i = 0; !fill && i < n; i++) {
+            (*elements)[i] = (double) i;
+        }
+        result->vector = elements;
+        return true;
+    }
+
+    if (strcmp(name, "dot") == 0) {
+        if (num_arguments != 2 || !get_operand(session_id, arguments[0], &first)
+            || !get_operand(session_id, arguments[1], &second) || !first.vector || !second.vector
+            || first.vector->size() != second.vector->size()) {
+            return false;
+        }
+        result->scalar = kernels->dot(first.vector->data(), second.vector->data(), first.vector->size());
+        return true;
+    }
+
+    // The rest reduce a single vector, which is never empty.
+    if (num_arguments != 1 || !get_operand(session_id, arguments[0], &first) || !first.vector) {
+        return false;
+    }
+
+    const double *elements = first.vector->data();
+    size_t n = first.vector->size();
+    if (strcmp(name, "sum") == 0) {
+        result->scalar = kernels->sum(elements, n);
+    } else if (strcmp(name, "min") == 0) {
+        result->scalar = kernels->min(elements, n);
+    } else if (strcmp(name, "max") == 0) {
+        result->scalar = kernels->max(elements, n);
+    } else {
+        result->scalar = (double) n;
+    }
+    return true;
+}
+
+/**
+ * Sets a variable of the session, interning its name.
+ *
+ * @param session_id the session ID
+ * @param name the variable name
+ * @param value the new value
+ * @return false if no more names can be interned
+ */
+bool assign_variable(int session_id, const char name[], const value_t & value) {
+    uint32_t variable = intern_name(name);
+    if (variable == NO_VARIABLE) {
+        return false;
+    }
+
+    set_variable(session_id, variable, true, value);
+    return true;
+}
+
+/**
+ * Process the given message and update the given session if it is valid.
+ * If the message is valid, the function will return true; otherwise, it will return false.
+ * Besides "<var> = <operand> [<op> <operand>]", a variable may be set to a vector literal
+ * "[v, v, ...]" or to the result of a vector function, "<var> = <function> <argument> ...".
+ * A function name followed by nothing or by an operation symbol is read as a variable.
+ *
+ * @param session_id the session ID
+ * @param message the message to be processed
+ * @return a boolean that determines if the given message is valid
+ */
+bool process_message(int session_id, const char message[]) {
+	// Would prefer a full rewrite of this function to make only one acceptable path to return true, and otherwise instantly return false.
+    char *token;
+    char result_name[MAX_NAME_LEN + 1];
+    value_t first_value;
+    char symbol;
+    value_t second_value;
+    value_t result;
+
+    // Makes a copy of the string since strtok() will modify the string that it is processing.
+    // Received messages always fit, but the copy must not trust that.
+    char data[BUFFER_LEN];
+    if (strlen(message) >= sizeof(data)) {
+        return false;
+    }
+    strcpy(data, message);
+
+    // Processes the result variable.
+    token = strtok(data, " ");
+	if (!is_identifier(token)) {
+		return false;
+	}
+    // The name is only interned once the whole command is known to be valid.
+    strcpy(result_name, token);
+
+    // Processes "=".
+    token = strtok(NULL, " ");
+
+	if (!token || token[0] != '=') {
+		return false;
+	}
+
+    // A vector literal may contain spaces, so it is parsed from the untouched message.
+    const char *rest = message + (token - data) + strlen(token);
+    while (*rest == ' ') {
+        rest++;
+    }
+    if (*rest == '[') {
+        if (!parse_value(rest, &rest, &result)) {
+            return false;
+        }
+        while (*rest == ' ') {
+            rest++;
+        }
+        return *rest == '\0' && assign_variable(session_id, result_name, result);
+    }
+
+    // Processes the first variable/value, or a function and its arguments.
+    token = strtok(NULL, " ");
+	if (!token) {
+		return false;
+	}
+    if (is_function(token)) {
+        char *name = token;
+        char *arguments[2];
+        int num_arguments = 0;
+
+        token = strtok(NULL, " ");
+        if (token && !(strchr("+-*/", token[0]) != NULL && token[1] == '\0')) {
+            for (; token; token = strtok(NULL, " ")) {
+                if (num_arguments == 2) {
+                    return false;
+                }
+                arguments[num_arguments++] = token;
+            }
+            if (!apply_function(session_id, name, arguments, num_arguments, &result)) {
+                return false;
+            }
+            return assign_variable(session_id, result_name, result);
+        }
+        if (!get_operand(session_id, name, &first_value)) {
+            return false;
+        }
+    } else {
+        if (!get_operand(session_id, token, &first_value)) {
+            return false;
+        }
+        token = strtok(NULL, " ");
+    }
+
+    // Processes the operation symbol.
+    if (token == NULL) {
+        return assign_variable(session_id, result_name, first_value);
+    }
+    symbol = token[0];
+
+	if (symbol != '*' && symbol != '+' && symbol != '-' && symbol != '/') {
+		return false;
+	}
+
+    // Processes the second variable/value.
+    token = strtok(NULL, " ");
+	if (!token) {
+		return false;
+	}
+    if (!get_operand(session_id, token, &second_value)) {
+		return false;
+    }
+	if (is_str_numeric(token) && second_value.scalar == '0' && symbol == '/') {
+		return false;
+	}
+
+    // No data should be left over thereafter.
+    token = strtok(NULL, " ");
+	if (token) {
+		return false;
+	}
+
+    if (!apply_operation(symbol, first_value, second_value, &result)) {
+        return false;
+    }
+
+    return assign_variable(session_id, result_name, result);
+}
+
+/**
+ * Gets the path for the history file of the given session.
+ * Mutations evicted from the in-memory ring buffer are appended to it.
+ *
+ * @param session_id the session ID
+ * @param path the path to the history file associated with the given session ID
+ */
+void get_history_file_path(int session_id, char path[]) {
+    sprintf(path, "%s/session%d.hist", DATA_DIR, session_id);
+}
+
+/**
+ * Continues the history of a session loaded from the disk. Sequence numbers pick up after the
+ * last spilled mutation, skipping one for the mutations that were still in memory when the
+ * previous server stopped; the loaded state is the earliest one that can be queried.
+ *
+ * @param session_id the session ID
+ */
+void load_history(int session_id) {
+    history_t &history = session_list[session_id].history;
+    long long last_seq = -1;
+    char path[SESSION_PATH_LEN];
+    get_history_file_path(session_id, path);
+
+    // Lines holding vectors can be long, so the file is read line by line rather than in chunks.
+    std::ifstream history_file(path);
+    std::string line;
+    while (std::getline(history_file, line)) {
+        last_seq = std::max(last_seq, strtoll(line.c_str(), NULL, 10));
+    }
+
+    history.next_seq = last_seq + 2;
+    history.floor_seq = last_seq + 1;
+}
+
+/**
+ * Appends a value to a line of the history file with every digit, so that it reads back exactly.
+ *
+ * @param value the value
+ * @param line the line
+ */
+static void append_exact_value(const value_t & value, std::string & line) {
+    if (value.vector) {
+        vector_to_str(*value.vector, MAX_VECTOR_LEN, true, line);
+        return;
+    }
+
+    char scalar[32];
+    sprintf(scalar, "%.17g", value.scalar);
+    line += scalar;
+}
+
+/**
+ * Returns the memory a history entry holds, counting the elements of its vectors. A vector shared
+ * with the session or with other entries is counted by each of them, so the count errs high.
+ *
+ * @param entry the history entry
+ * @return the number of bytes
+ */
+static size_t entry_bytes(const history_entry_t & entry) {
+    size_t bytes = sizeof(entry);
+    if (entry.old_value.vector) {
+        bytes += entry.old_value.vector->size() * sizeof(double);
+    }
+    if (entry.new_value.vector) {
+        bytes += entry.new_value.vector->size() * sizeof(double);
+    }
+    return bytes;
+}
+
+/**
+ * Drops the newest entry of the ring after it was undone.
+ *
+ * @param history the history
+ */
+static void pop_newest_entry(history_t & history) {
+    history.count--;
+    history_entry_t &entry = history.entries[(history.head + history.count) % history_len];
+    history.bytes -= entry_bytes(entry);
+    entry.old_value.vector.reset();
+    entry.new_value.vector.reset();
+}
+
+/**
+ * Sets a variable of the session and records the change in its history under the given sequence
+ * number, which becomes the newest one. A replica passes the number the primary gave the change,
+ * so that AT and DIFF name the same states on both.
+ * When the ring buffer is full, or its entries would hold more than history_bytes, its oldest
+ * entries move to the unwritten entries, which write_spilled_history() appends to the history
+ * file once the session lock is released. The newest entry always stays, so that it can be undone.
+ * Vectors are shared with the entry rather than copied.
+ *
+ * @param session_id the session ID
+ * @param seq the sequence number of the change; 0 stores it without recording it
+ * @param variable the variable ID
+ * @param defined whether the variable is set afterwards
+ * @param value the new value of the variable
+ */
+void install_variable(int session_id, long long seq, uint32_t variable, bool defined, const value_t & value) {
+    session_t &session = session_list[session_id];
+    history_t &history = session.history;
+
+    if (history_len > 0 && seq > 0) {
+        if (history.entries == NULL) {
+            history.entries = new history_entry_t[history_len]();
+            history.head = 0;
+            history.count = 0;
+            history.bytes = 0;
+        }
+
+        history_entry_t change;
+        change.seq = seq;
+        change.variable = variable;
+        change.had_old = get_variable(session_id, variable, &change.old_value);
+        change.has_new = defined;
+        change.new_value = value;
+        size_t change_bytes = entry_bytes(change);
+
+        while (history.count == history_len || (history.count > 0 && history.bytes + change_bytes > history_bytes)) {
+            history_entry_t &oldest = history.entries[history.head];
+            history.unwritten.push_back(oldest);
+            history.bytes -= entry_bytes(oldest);
+
+            // Drops the entry's vectors now rather than when its slot is reused.
+            oldest.old_value.vector.reset();
+            oldest.new_value.vector.reset();
+            history.head = (history.head + 1) % history_len;
+            history.count--;
+        }
+
+        history.entries[(history.head + history.count) % history_len] = change;
+        history.next_seq = seq + 1;
+        history.bytes += change_bytes;
+        history.count++;
+    }
+
+    store_variable(session_id, variable, defined, value);
+}
+
+/**
+ * Sets a variable of the session, records the change in its history under the next sequence
+ * number, and streams it with that number to every replica.
+ *
+ * @param session_id the session ID
+ * @param variable the variable ID
+ * @param defined whether the variable is set afterwards
+ * @param value the new value of the variable
+ */
+void set_variable(int session_id, uint32_t variable, bool defined, const value_t & value) {
+    history_t &history = session_list[session_id].history;
+    long long seq = 0;
+
+    if (history_len > 0) {
+        seq = history.next_seq > 0 ? history.next_seq : 1;
+    }
+
+    install_variable(session_id, seq, variable, defined, value);
+    replicate_change(defined ? "SET" : "DEL", session_id, seq, variable, defined, value);
+}
+
+/**
+ * Appends the entries pushed out of the session's ring buffer to its history file, oldest first.
+ * The entries are copied under the session lock, sharing their vectors, and formatted and written
+ * without it; they stay in memory until they are in the file, so queries always find them in one
+ * place or the other. Must be called without the session lock held.
+ *
+ * @param session_id the session ID
+ */
+void write_spilled_history(int session_id) {
+    std::vector<history_entry_t> entries;
+    std::string lines;
+    long long last_seq = 0;
+    char path[SESSION_PATH_LEN];
+    get_history_file_path(session_id, path);
+
+    // The disk lock keeps appends in order, so the file stays sorted by sequence number.
+    pthread_mutex_lock(&disk_mutex);
+    pthread_mutex_lock(&session_list_mutex);
+    std::unordered_map<int, session_t>::iterator it = session_list.find(session_id);
+    if (it != session_list.end()) {
+        entries = it->second.history.unwritten;
+    }
+    pthread_mutex_unlock(&session_list_mutex);
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        // Spilled entries name their variable, since IDs are only stable within one run.
+        lines += std::to_string(entries[i].seq) + " " + variable_name(entries[i].variable) + " ";
+        lines += entries[i].had_old ? "1 " : "0 ";
+        append_exact_value(entries[i].old_value, lines);
+        lines += entries[i].has_new ? " 1 " : " 0 ";
+        append_exact_value(entries[i].new_value, lines);
+        lines += '\n';
+        last_seq = entries[i].seq;
+    }
+
+    if (!lines.empty()) {
+        FILE *history_file = fopen(path, "a");
+        if (history_file != NULL) {
+            fwrite(lines.data(), 1, lines.size(), history_file);
+            fclose(history_file);
+        }
+
+        // More entries may have been pushed out meanwhile; only the written ones are dropped.
+        pthread_mutex_lock(&session_list_mutex);
+        it = session_list.find(session_id);
+        if (it != session_list.end()) {
+            std::vector<history_entry_t> &unwritten = it->second.history.unwritten;
+            size_t written = 0;
+            while (written < unwritten.size() && unwritten[written].seq <= last_seq) {
+                written++;
+            }
+            unwritten.erase(unwritten.begin(), unwritten.begin() + written);
+        }
+        pthread_mutex_unlock(&session_list_mutex);
+    }
+    pthread_mutex_unlock(&disk_mutex);
+}
+
+/**
+ * Parses a mutation spilled to the history file:
+ * "<seq> <name> <had_old> <old_value> <has_new> <new_value>".
+ *
+ * @param line the line of the history file
+ * @param entry set to the mutation; its variable is NO_VARIABLE if the name cannot be interned
+ * @return false if the line is malformed
+ */
+bool parse_history_line(const std::string & line, history_entry_t * entry) {
+    char name[MAX_NAME_LEN + 1];
+    int had_old;
+    int has_new;
+    int length;
+
+    if (sscanf(line.c_str(), "%lld %63s %d%n", &entry->seq, name, &had_old, &length) != 3) {
+        return false;
+    }
+
+    const char *rest = line.c_str() + length;
+    if (!parse_value(rest, &rest, &entry->old_value) || sscanf(rest, "%d%n", &has_new, &length) != 1) {
+        return false;
+    }
+    rest += length;
+    if (!parse_value(rest, &rest, &entry->new_value)) {
+        return false;
+    }
+
+    entry->variable = intern_name(name);
+    entry->had_old = had_old;
+    entry->has_new = has_new;
+    return true;
+}
+
+/**
+ * Reverts the newest mutation of the session that is still in memory, and streams the UNDO
+ * to every replica. Sequence numbers are never reused, so an undone mutation simply disappears
+ * from the timeline.
+ *
+ * @param session_id the session ID
+ * @return false if there is nothing in memory to undo
+ */
+bool undo_mutation(int session_id) {
+    history_t &history = session_list[session_id].history;
+
+    if (history.count == 0) {
+        return false;
+    }
+
+    history_entry_t &entry = history.entries[(history.head + history.count - 1) % history_len];
+    store_variable(session_id, entry.variable, entry.had_old, entry.old_value);
+    replicate_change("UNDO", session_id, entry.seq, entry.variable, entry.had_old, entry.old_value);
+    pop_newest_entry(history);
+
+    return true;
+}
+
+/**
+ * Applies an UNDO streamed by the primary: drops the undone mutation from the history and gives
+ * the variable the value the primary restored. A replica keeping a shorter history than the
+ * primary may already have pushed that mutation out of memory; the states before it can then
+ * no longer be reconstructed the way the primary does, so they stop being queryable.
+ *
+ * @param session_id the session ID
+ * @param seq the sequence number of the undone mutation
+ * @param variable the variable ID
+ * @param defined whether the variable is set afterwards
+ * @param value the restored value of the variable
+ */
+void apply_undo(int session_id, long long seq, uint32_t variable, bool defined, const value_t & value) {
+    history_t &history = session_list[session_id].history;
+
+    if (history.count > 0 && history.entries[(history.head + history.count - 1) % history_len].seq == seq) {
+        pop_newest_entry(history);
+    } else {
+        history.floor_seq = std::max(history.floor_seq, seq);
+    }
+
+    store_variable(session_id, variable, defined, value);
+}
+
+/**
+ * Reverts one mutation in a snapshot.
+ *
+ * @param snapshot the snapshot
+ * @param entry the mutation to revert
+ */
+static void revert_entry(snapshot_t & snapshot, const history_entry_t & entry) {
+    if (entry.had_old) {
+        snapshot[entry.variable] = entry.old_value;
+    } else {
+        snapshot.erase(entry.variable);
+    }
+}
+
+/**
+ * Reconstructs the variables of the session as they were right after the mutation with the
+ * given sequence number, by reverting every newer mutation. The ring buffer answers recent
+ * queries from memory, followed by the entries not yet written to the history file; only older
+ * ones read the spilled entries back from the file.
+ *
+ * @param session_id the session ID
+ * @param seq the sequence number
+ * @param snapshot a map to store the variables
+ * @return false if the state at that point is not known
+ */
+bool session_at(int session_id, long long seq, snapshot_t & snapshot) {
+    history_t &history = session_list[session_id].history;
+    long long latest = history.next_seq > 0 ? history.next_seq - 1 : 0;
+
+    if (seq < history.floor_seq || seq > latest) {
+        return false;
+    }
+
+    session_snapshot(session_id, snapshot);
+
+    for (size_t i = history.count; i > 0; i--) {
+        history_entry_t &entry = history.entries[(history.head + i - 1) % history_len];
+        if (entry.seq <= seq) {
+            return true;
+        }
+        revert_entry(snapshot, entry);
+    }
+
+    for (size_t i = history.unwritten.size(); i > 0; i--) {
+        history_entry_t &entry = history.unwritten[i - 1];
+        if (entry.seq <= seq) {
+            return true;
+        }
+        revert_entry(snapshot, entry);
+    }
+
+    // The rest of the way back is in the history file.
+    long long oldest_in_memory = !history.unwritten.empty() ? history.unwritten[0].seq
+                                 : history.count > 0 ? history.entries[history.head].seq : latest + 1;
+    if (seq >= oldest_in_memory - 1) {
+        return true;
+    }
+
+    char path[SESSION_PATH_LEN];
+    get_history_file_path(session_id, path);
+    std::ifstream history_file(path);
+    if (!history_file.good()) {
+        return false;
+    }
+
+    std::vector<history_entry_t> spilled;
+    history_entry_t entry;
+    std::string line;
+    while (std::getline(history_file, line)) {
+        if (strtoll(line.c_str(), NULL, 10) <= seq) {
+            continue;
+        }
+        if (!parse_history_line(line, &entry)) {
+            break;
+        }
+        if (entry.seq < oldest_in_memory && entry.variable != NO_VARIABLE) {
+            spilled.push_back(entry);
+        }
+    }
+
+    for (size_t i = spilled.size(); i > 0; i--) {
+        revert_entry(snapshot, spilled[i - 1]);
+    }
+
+    return true;
+}
+
+/**
+ * Determines if the given command is one of the history commands.
+ *
+ * @param command the command received
+ * @return true for "UNDO", "AT ..." and "DIFF ..."
+ */
+bool is_history_command(const char command[]) {
+    return strcmp(command, "UNDO") == 0 || strncmp(command, "AT ", 3) == 0 || strncmp(command, "DIFF ", 5) == 0;
+}
+
+/**
+ * Answers the history commands. "UNDO" reverts the newest mutation, "AT <seq>" returns the
+ * session as it was right after mutation <seq>, and "DIFF <seq1> <seq2>" lists the variables
+ * that differ between those two points.
+ *
+ * @param session_id the session ID
+ * @param command the command received
+ * @param response a string to store the answer for the requesting browser;
+ *                 left empty if the session should be broadcast instead
+ * @param mutated set to true if the session changed
+ * @return false if the command is not a history command, or is invalid
+ */
+bool process_history_command(int session_id, const char command[], std::string & response, bool *mutated) {
+    snapshot_t snapshot;
+    char *end;
+
+    response.clear();
+    *mutated = false;
+
+    if (strcmp(command, "UNDO") == 0) {
+        *mutated = undo_mutation(session_id);
+        return *mutated;
+    }
+
+    if (strncmp(command, "AT ", 3) == 0) {
+        long long seq = strtoll(command + 3, &end, 10);
+        if (end == command + 3 || *end != '\0' || !session_at(session_id, seq, snapshot)) {
+            return false;
+        }
+
+        std::string state;
+        snapshot_to_str(snapshot, VECTOR_PREVIEW_LEN, state);
+        response = "AT " + std::to_string(seq) + ":\n" + state;
+        return true;
+    }
+
+    if (strncmp(command, "DIFF ", 5) == 0) {
+        long long first_seq = strtoll(command + 5, &end, 10);
+        const char *rest = end;
+        long long second_seq = strtoll(rest, &end, 10);
+        if (end == rest || *end != '\0') {
+            return false;
+        }
+
+        snapshot_t second;
+        if (!session_at(session_id, first_seq, snapshot) || !session_at(session_id, second_seq, second)) {
+            return false;
+        }
+
+        response = "DIFF " + std::to_string(first_seq) + " " + std::to_string(second_seq) + ":\n";
+        std::vector<uint32_t> ids = display_order(snapshot, second);
+        for (size_t i = 0; i < ids.size(); i++) {
+            snapshot_t::iterator before = snapshot.find(ids[i]);
+            snapshot_t::iterator after = second.find(ids[i]);
+            if (before != snapshot.end() && after != second.end() && values_equal(before->second, after->second)) {
+                continue;
+            }
+
+            response += variable_name(ids[i]);
+            response += ": ";
+            if (before != snapshot.end()) {
+                variable_value_to_str(before->second, VECTOR_PREVIEW_LEN, response);
+            } else {
+                response += "(unset)";
+            }
+            response += " -> ";
+            if (after != second.end()) {
+                variable_value_to_str(after->second, VECTOR_PREVIEW_LEN, response);
+            } else {
+                response += "(unset)";
+            }
+            response += '\n';
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Runs a browser command against a session: a history command or an assignment.
+ * This is the whole path from a received command to its answer that does not involve a socket.
+ * Must be called with the session lock held.
+ *
+ * @param session_id the session ID
+ * @param command the command received
+ * @param response set to the answer for the requesting browser, or to the session
+ *                 to broadcast if the command changed it
+ * @param mutated set to true if the session changed
+ * @return false if the command is invalid
+ */
+bool execute_command(int session_id, const char command[], std::string & response, bool * mutated) {
+    bool data_valid;
+
+    response.clear();
+    if (is_history_command(command)) {
+        data_valid = process_history_command(session_id, command, response, mutated);
+    } else {
+        data_valid = *mutated = process_message(session_id, command);
+    }
+
+    if (data_valid && *mutated) {
+        session_to_str(session_id, VECTOR_PREVIEW_LEN, response);
+    }
+    return data_valid;
+}
+
+/**
+ * Returns the time of a monotonic clock in milliseconds.
+ *
+ * @return the current time
+ */
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Writes the browser's queued frames. A browser whose socket stays full for
+ * SEND_TIMEOUT seconds, or fails, is shut down so that its handler reaps it.
+ *
+ * @param browser_id the browser ID
+ */
+void flush_browser(int browser_id) {
+    browser_t *browser = &browser_list[browser_id];
+
+    if (outbound_flush(&browser->outbound, browser->socket_fd) && !outbound_is_stalled(&browser->outbound)) {
+        return;
+    }
+
+    pthread_mutex_lock(&browser_list_mutex);
+    if (browser->in_use) {
+        shutdown(browser->socket_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&browser_list_mutex);
+}
+
+/**
+ * Sends the given message to a single browser through its outbound queue,
+ * so that it never interleaves with a broadcast being written to the same socket.
+ *
+ * @param browser_id the browser ID
+ * @param message the message to be sent
+ */
+void send_to_browser(int browser_id, const char message[]) {
+    frame_t *frame = frame_create(message, strlen(message));
+    outbound_push(&browser_list[browser_id].outbound, frame);
+    frame_release(frame);
+    flush_browser(browser_id);
+}
+
+/**
+ * Sends the given message about the given session to a single browser.
+ * Multiplexed browsers get the message tagged as "@<session_id>\n<message>".
+ *
+ * @param browser_id the browser ID
+ * @param session_id the session the message is about
+ * @param message the message to be sent
+ */
+void reply_to_browser(int browser_id, int session_id, const char message[]) {
+    if (!browser_list[browser_id].multiplexed) {
+        send_to_browser(browser_id, message);
+        return;
+    }
+
+    std::string tagged = "@" + std::to_string(session_id) + "\n" + message;
+    send_to_browser(browser_id, tagged.c_str());
+}
+
+/**
+ * Queues the given message on every browser subscribed to the session, without writing it;
+ * each subscriber's queue is then flushed with a single writev.
+ * Each frame is built once and queued by reference on every subscriber.
+ * Multiplexed subscribers share one tagged copy of the frame.
+ *
+ * @param session_id the session ID
+ * @param message the message to be broadcasted
+ * @param subscribers the browsers it was queued on are appended here; flush them afterwards
+ */
+void queue_broadcast(int session_id, const char message[], std::vector<int> & subscribers) {
+    frame_t *plain = NULL;
+    frame_t *tagged = NULL;
+
+    pthread_mutex_lock(&browser_list_mutex);
+    std::unordered_map<int, std::vector<int> >::iterator it = subscriber_list.find(session_id);
+    if (it != subscriber_list.end()) {
+        for (size_t i = 0; i < it->second.size(); ++i) {
+            int browser_id = it->second[i];
+
+            if (browser_list[browser_id].multiplexed) {
+                if (tagged == NULL) {
+                    std::string text = "@" + std::to_string(session_id) + "\n" + message;
+                    tagged = frame_create(text.c_str(), text.size());
+                }
+                outbound_push(&browser_list[browser_id].outbound, tagged);
+            } else {
+                if (plain == NULL) {
+                    plain = frame_create(message, strlen(message));
+                }
+                outbound_push(&browser_list[browser_id].outbound, plain);
+            }
+            subscribers.push_back(browser_id);
+        }
+    }
+    pthread_mutex_unlock(&browser_list_mutex);
+
+    if (plain != NULL) {
+        frame_release(plain);
+    }
+    if (tagged != NULL) {
+        frame_release(tagged);
+    }
+}
+
+/**
+ * Gets the path for the given session.
+ *
+ * @param session_id the session ID
+ * @param path the path to the session file associated with the given session ID
+ */
+void get_session_file_path(int session_id, char path[]) {
+    sprintf(path, "%s/session%d.dat", DATA_DIR, session_id);
+}
+
+/**
+ * Loads the variables of a session from the contents of its file,
+ * one "<name> = <value>" line per variable; a vector is written as "[v, v, ...]".
+ *
+ * @param session_id the session ID
+ * @param session_file the contents of the session file
+ * @return false if the file is malformed; the lines before the error are kept
+ */
+bool load_session_stream(int session_id, std::istream & session_file) {
+	std::string line;
+
+	while (std::getline(session_file, line)) {
+		char name[MAX_NAME_LEN + 1];
+		char equals[2];
+		int length;
+		const char *rest;
+		value_t val;
+
+		if (line.empty()) {
+			continue;
+		}
+		if (sscanf(line.c_str(), "%63s %1s%n", name, equals, &length) != 2 || equals[0] != '='
+			|| !parse_value(line.c_str() + length, &rest, &val)) {
+			return false;
+		}
+
+		uint32_t variable = intern_name(name);
+		if (variable == NO_VARIABLE) {
+			return false;
+		}
+		store_variable(session_id, variable, true, val);
+	}
+
+	return true;
+}
+
+/**
+ * Loads every session from the disk one by one if it exists.
+ * Use get_session_file_path() to get the file path for each session.
+ */
+void load_all_sessions() {
+	char path[SESSION_PATH_LEN];
+	std::ifstream session_file;
+	std::ifstream sessions_list;
+
+	sessions_list.open(SESSIONS_PATH);
+
+	if (!sessions_list.good()) {
+		std::ofstream create_backup;
+		create_backup.open(SESSIONS_PATH);
+		create_backup.close();
+	}
+
+	int id = -1;
+	int prev_id = -1;
+	char c2;
+	while (sessions_list.good() && !sessions_list.eof()) {
+		sessions_list >> id;
+		sessions_list.get(c2);
+		get_session_file_path(id, path);
+		session_file.open(path);
+		if (id == prev_id) {
+			break;
+		}
+		if (!session_file.good()) {
+			printf("Error acquiring Session %d information.\n", id);
+			continue;
+		}
+		prev_id = id;
+		session_list[id].in_use = true;
+		if (!load_session_stream(id, session_file)) {
+			printf("Error with Session %d file formatting.\n", id);
+		}
+		session_file.close();
+		load_history(id);
+	}
+}
+
+/**
+ * Saves the given contents of a session to the disk, unless a newer version of the session
+ * was saved first by another thread. Must be called without the session lock held.
+ * Use get_session_file_path() to get the file path for each session.
+ *
+ * @param session_id the session ID
+ * @param version the session's version the contents were taken at
+ * @param contents the session file, with every element of its vectors
+ */
+void save_session(int session_id, long long version, const std::string & contents) {
+	char path[BUFFER_LEN];
+	bool saved = false;
+	std::ofstream session_file;
+	std::ifstream sessions_list;
+	std::ofstream sessions_output;
+
+	pthread_mutex_lock(&disk_mutex);
+	std::unordered_map<int, long long>::iterator newest = saved_versions.find(session_id);
+	if (newest != saved_versions.end() && newest->second >= version) {
+		pthread_mutex_unlock(&disk_mutex);
+		return;
+	}
+	saved_versions[session_id] = version;
+
+	sessions_list.open(SESSIONS_PATH);
+
+	int id = -1;
+	char c;
+	while (!sessions_list.eof()) {
+		sessions_list >> id;
+		sessions_list.get(c);
+		if (id == -1) {
+			break;
+		}
+		if (id == session_id) {
+			saved = true;
+		}
+	}
+
+	sessions_list.close();
+
+	if (!saved) {
+		sessions_output.open(SESSIONS_PATH, std::ios::app);
+		sessions_output << session_id;
+		sessions_output << '\n';
+		sessions_output.close();
+	}
+
+	get_session_file_path(session_id, path);
+	std::string temp_path = std::string(path) + ".tmp";
+	session_file.open(temp_path.c_str());
+
+	session_file << contents;
+
+	session_file.close();
+
+	// Files with large vectors take a while to write, so the old one is only replaced once the new one is complete.
+	rename(temp_path.c_str(), path);
+	pthread_mutex_unlock(&disk_mutex);
+}
+
+/**
+ * Queues the broadcast of a changed session and takes a snapshot of what must be saved;
+ * formatting it is left to finish_session_io().
+ * Must be called with the session lock held, right after the change.
+ *
+ * @param session_id the session ID
+ * @param response the session to broadcast
+ * @param io set to the work left for finish_session_io()
+ */
+void prepare_session_io(int session_id, const std::string & response, session_io_t & io) {
+	io.session_id = session_id;
+	io.version = ++session_list[session_id].version;
+	io.subscribers.clear();
+	queue_broadcast(session_id, response.c_str(), io.subscribers);
+	session_snapshot(session_id, io.snapshot);
+}
+
+/**
+ * Writes what a change of a session queued: the broadcast, the changes queued on the replicas,
+ * the session file and any history pushed out of memory. Must be called without the session
+ * lock held, so that a slow browser, replica or disk holds up only the thread that made the change.
+ *
+ * @param io the work prepare_session_io() left
+ */
+void finish_session_io(const session_io_t & io) {
+	for (size_t i = 0; i < io.subscribers.size(); ++i) {
+		flush_browser(io.subscribers[i]);
+	}
+	flush_replicas();
+
+	// The file keeps every element of a vector, unlike the broadcasts.
+	std::string contents;
+	snapshot_to_str(io.snapshot, MAX_VECTOR_LEN, contents);
+	save_session(io.session_id, io.version, contents);
+	write_spilled_history(io.session_id);
+}
+
+/**
+ * Builds the replication frame that sets, unsets or undoes a change of a variable. The log is
+ * row-based: it carries the new value rather than the command, so replicas never re-run the parser.
+ * Every change also carries the sequence number the session's history gave it (0 if it was not
+ * recorded), so that replicas number their history like the primary.
+ * "SET <lsn> <session_id> <seq> <name> S <value>" sets a scalar,
+ * "SET <lsn> <session_id> <seq> <name> V <n>" followed by a newline and the n elements as raw
+ * doubles sets a vector, and "DEL <lsn> <session_id> <seq> <name>" unsets a variable.
+ * "UNDO <lsn> <session_id> <seq> <name>" reverts mutation <seq>, leaving the variable unset,
+ * or set to the value that follows in the same form as for SET. Raw doubles keep vectors exact
+ * and cheap to apply, so the primary and its replicas must share a byte order.
+ *
+ * @param kind "SET", "DEL" or "UNDO"
+ * @param lsn the sequence number of the change in the log
+ * @param session_id the session ID
+ * @param seq the sequence number of the change in the session's history
+ * @param variable the variable ID
+ * @param defined whether the variable is set afterwards
+ * @param value the new value of the variable
+ * @return the frame, with a reference count of one
+ */
+frame_t * build_change_frame(const char kind[], long long lsn, int session_id, long long seq, uint32_t variable,
+                             bool defined, const value_t & value) {
+    char header[192];
+    int length = sprintf(header, "%s %lld %d %lld %s", kind, lsn, session_id, seq, variable_name(variable));
+
+    if (!defined) {
+        return frame_create(header, length);
+    }
+
+    if (!value.vector) {
+        length += sprintf(header + length, " S %.17g", value.scalar);
+        return frame_create(header, length);
+    }
+
+    sprintf(header + length, " V %zu\n", value.vector->size());
+    std::string payload(header);
+    payload.append((const char *) value.vector->data(), value.vector->size() * sizeof(double));
+    return frame_create(payload.data(), payload.size());
+}
+
+/**
+ * Streams a change of a variable to every replica. The frame is built once and queued by
+ * reference, like a broadcast; flush_replicas() writes it once the session lock is released.
+ * Must be called with the session lock held, which orders the changes.
+ *
+ * @param kind "SET", "DEL" or "UNDO"
+ * @param session_id the session ID
+ * @param seq the sequence number of the change in the session's history
+ * @param variable the variable ID
+ * @param defined whether the variable is set afterwards
+ * @param value the new value of the variable
+ */
+void replicate_change(const char kind[], int session_id, long long seq, uint32_t variable, bool defined,
+                      const value_t & value) {
+    frame_t *frame = NULL;
+
+    replication_lsn++;
+    for (int i = 0; i < NUM_REPLICAS; i++) {
+        replica_t *replica = &replica_list[i];
+        if (!replica->in_use) {
+            continue;
+        }
+
+        if (frame == NULL) {
+            frame = build_change_frame(kind, replication_lsn, session_id, seq, variable, defined, value);
+        }
+        outbound_push(&replica->outbound, frame);
+    }
+
+    if (frame != NULL) {
+        frame_release(frame);
+    }
+}
+
+/**
+ * Writes the changes queued on every replica. A replica that stops reading is shut down;
+ * it reconnects and starts over from a new snapshot.
+ * Must be called without the session lock held. Frames were queued in order under the lock,
+ * and only one thread writes a queue at a time, so the stream stays in order.
+ */
+void flush_replicas() {
+    for (int i = 0; i < NUM_REPLICAS; i++) {
+        replica_t *replica = &replica_list[i];
+        if (!replica->in_use) {
+            continue;
+        }
+
+        if (!outbound_flush(&replica->outbound, replica->socket_fd) || outbound_is_stalled(&replica->outbound)) {
+            shutdown(replica->socket_fd, SHUT_RDWR);
+        }
+    }
+}
+
+/**
+ * Queues a snapshot of every session on the replica: "SNAPSHOT <lsn>", then for each session
+ * "SEQ <lsn> <session_id> <next_seq>", which carries where its history numbering goes on, and one
+ * "SET" frame per variable, then "READY <lsn>". Must be called with the session lock held, so
+ * that the changes streamed afterwards pick up exactly where the snapshot ends.
+ *
+ * @param replica_id the replica ID
+ */
+void send_snapshot(int replica_id) {
+    outbound_t *out = &replica_list[replica_id].outbound;
+    char message[64];
+
+    sprintf(message, "SNAPSHOT %lld", replication_lsn);
+    frame_t *frame = frame_create(message, strlen(message));
+    outbound_push(out, frame);
+    frame_release(frame);
+
+    std::unordered_map<int, session_t>::iterator it;
+    for (it = session_list.begin(); it != session_list.end(); ++it) {
+        snapshot_t snapshot;
+        session_snapshot(it->first, snapshot);
+
+        sprintf(message, "SEQ %lld %d %lld", replication_lsn, it->first, it->second.history.next_seq);
+        frame = frame_create(message, strlen(message));
+        outbound_push(out, frame);
+        frame_release(frame);
+
+        for (snapshot_t::iterator variable = snapshot.begin(); variable != snapshot.end(); ++variable) {
+            frame = build_change_frame("SET", replication_lsn, it->first, 0, variable->first, true, variable->second);
+            outbound_push(out, frame);
+            frame_release(frame);
+        }
+    }
+
+    sprintf(message, "READY %lld", replication_lsn);
+    frame = frame_create(message, strlen(message));
+    outbound_push(out, frame);
+    frame_release(frame);
+}
+
+/**
+ * Frees the replica's slot and its socket.
+ *
+ * @param replica_id the replica ID
+ */
+void remove_replica(int replica_id) {
+    replica_t *replica = &replica_list[replica_id];
+
+    pthread_mutex_lock(&session_list_mutex);
+    replica->in_use = false;
+    shutdown(replica->socket_fd, SHUT_RDWR);
+    outbound_clear(&replica->outbound);
+    close(replica->socket_fd);
+    pthread_mutex_unlock(&session_list_mutex);
+}
+
+/**
+ * Registers a replica that sent "REPLICA", sends it a snapshot, and streams changes to it
+ * until it disconnects. A server that is itself still a replica refuses other replicas.
+ *
+ * @param replica_socket_fd the socket file descriptor of the replica connected
+ */
+void * replica_handler(void * rs_fd) {
+	int socket_fd = *((int *) rs_fd);
+	free(rs_fd);
+
+	char message[BUFFER_LEN];
+	int replica_id = -1;
+	long long lsn = 0;
+
+	if (receive_message(socket_fd, message) <= 0 || strcmp(message, "REPLICA") != 0) {
+		close(socket_fd);
+		return NULL;
+	}
+
+	// Queuing the snapshot and joining the stream happen under one lock, so no change is missed or repeated.
+	pthread_mutex_lock(&session_list_mutex);
+	for (int i = 0; i < NUM_REPLICAS && !is_replica; ++i) {
+		if (!replica_list[i].in_use) {
+			replica_id = i;
+			replica_list[i].in_use = true;
+			replica_list[i].socket_fd = socket_fd;
+			outbound_attach(&replica_list[i].outbound, socket_fd, zerocopy_enabled);
+			send_snapshot(i);
+			lsn = replication_lsn;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&session_list_mutex);
+
+	if (replica_id == -1) {
+		printf("Refused a replica.\n");
+		close(socket_fd);
+		return NULL;
+	}
+
+	printf("Replica #%d connected; streaming from LSN %lld.\n", replica_id, lsn);
+	if (!outbound_flush(&replica_list[replica_id].outbound, socket_fd)) {
+		shutdown(socket_fd, SHUT_RDWR);
+	}
+
+	// Replicas send nothing after registering; this only waits for the connection to end.
+	while (receive_message(socket_fd, message) > 0) {
+	}
+
+	remove_replica(replica_id);
+	printf("Replica #%d disconnected.\n", replica_id);
+	return NULL;
+}
+
+/**
+ * Accepts replicas on the replication port and creates handlers for them.
+ */
+void * replication_listener(void * arg) {
+	int listener_fd = open_listener(replicate_port);
+	printf("Replicas may connect on port %d.\n", replicate_port);
+
+	while (true) {
+		int replica_socket_fd = accept(listener_fd, NULL, NULL);
+		if (replica_socket_fd < 0) {
+			perror("Replica accept failed");
+			continue;
+		}
+
+		configure_browser_socket(replica_socket_fd);
+
+		int *handler_fd = (int *) malloc(sizeof(int));
+		*handler_fd = replica_socket_fd;
+		pthread_t thread_id;
+		if (pthread_create(&thread_id, NULL, &replica_handler, handler_fd) != 0) {
+			perror("Handler creation failed");
+			free(handler_fd);
+			close(replica_socket_fd);
+			continue;
+		}
+		pthread_detach(thread_id);
+	}
+
+	return arg;
+}
+
+/**
+ * Clears every variable and the history of a session before a snapshot replaces them.
+ * The history restarts at the current sequence number, so AT and DIFF cannot reach
+ * past the snapshot.
+ *
+ * @param session_id the session ID
+ */
+void reset_session(int session_id) {
+    session_t &session = session_list[session_id];
+    history_t &history = session.history;
+
+    memset(session.variables, 0, sizeof(session.variables));
+    memset(session.values, 0, sizeof(session.values));
+    if (session.named != NULL) {
+        symtab_free(session.named);
+        session.named = NULL;
+    }
+    delete session.vectors;
+    session.vectors = NULL;
+
+    delete[] history.entries;
+    history.entries = NULL;
+    history.head = 0;
+    history.count = 0;
+    history.bytes = 0;
+    history.floor_seq = history.next_seq > 0 ? history.next_seq - 1 : 0;
+}
+
+/**
+ * Frees a session and forgets it, as if it had never been used; its files are left alone.
+ * The fuzzing harness uses it to start every input from the same state.
+ *
+ * @param session_id the session ID
+ */
+void discard_session(int session_id) {
+    reset_session(session_id);
+    session_list.erase(session_id);
+}
+
+/**
+ * Applies one frame of the replication stream. The variables in a snapshot are stored quietly;
+ * "READY" then saves and broadcasts every session once. A streamed change is applied like a
+ * local one: it is recorded in the history under the primary's sequence number, saved, and
+ * broadcast to the local browsers. A streamed UNDO drops the same mutation the primary did.
+ * Must be called with the session lock held; the saves and broadcasts are left in io.
+ *
+ * @param payload the frame payload
+ * @param in_snapshot whether a snapshot is being received; updated by "SNAPSHOT" and "READY"
+ * @param io the work for finish_session_io() is appended here, one entry per changed session
+ * @return false if the frame is malformed or out of order
+ */
+bool apply_change(const std::string & payload, bool * in_snapshot, std::vector<session_io_t> & io) {
+    const char *data = payload.c_str();
+    char kind[16];
+    char name[MAX_NAME_LEN + 1];
+    long long lsn;
+    long long seq;
+    int session_id;
+    int length;
+
+    if (sscanf(data, "SNAPSHOT %lld", &lsn) == 1) {
+        std::unordered_map<int, session_t>::iterator it;
+        for (it = session_list.begin(); it != session_list.end(); ++it) {
+            reset_session(it->first);
+        }
+        *in_snapshot = true;
+        return true;
+    }
+
+    // The history of a session restarts where the primary's goes on; reset_session() already
+    // made the states before the snapshot unreachable.
+    if (sscanf(data, "SEQ %lld %d %lld", &lsn, &session_id, &seq) == 3) {
+        if (!*in_snapshot) {
+            return false;
+        }
+        history_t &history = session_list[session_id].history;
+        history.next_seq = seq;
+        history.floor_seq = seq > 0 ? seq - 1 : 0;
+        return true;
+    }
+
+    if (sscanf(data, "READY %lld", &lsn) == 1) {
+        std::string response;
+        std::unordered_map<int, session_t>::iterator it;
+        for (it = session_list.begin(); it != session_list.end(); ++it) {
+            if (it->second.in_use) {
+                session_to_str(it->first, VECTOR_PREVIEW_LEN, response);
+                io.push_back(session_io_t());
+                prepare_session_io(it->first, response, io.back());
+            }
+        }
+        replication_lsn = lsn;
+        *in_snapshot = false;
+        printf("Caught up with the primary at LSN %lld.\n", lsn);
+        return true;
+    }
+
+    if (sscanf(data, "%15s %lld %d %lld %63s%n", kind, &lsn, &session_id, &seq, name, &length) != 5) {
+        return false;
+    }
+
+    // Outside a snapshot every change must follow the last one applied.
+    bool undo = strcmp(kind, "UNDO") == 0;
+    if ((!undo && strcmp(kind, "SET") != 0 && strcmp(kind, "DEL") != 0) || (undo && *in_snapshot)
+        || (!*in_snapshot && lsn != replication_lsn + 1)) {
+        return false;
+    }
+
+    // A SET always carries a value, a DEL never does, and an UNDO does if it leaves the variable set.
+    const char *rest = data + length;
+    char type;
+    int offset;
+    bool defined = sscanf(rest, " %c%n", &type, &offset) == 1;
+    if (defined != (strcmp(kind, "SET") == 0) && !undo) {
+        return false;
+    }
+
+    value_t value;
+    value.scalar = 0.0;
+    if (defined) {
+        rest += offset;
+
+        if (type == 'S') {
+            if (!parse_value(rest, &rest, &value) || value.vector) {
+                return false;
+            }
+        } else if (type == 'V') {
+            size_t n = strtoul(rest, NULL, 10);
+            size_t elements = payload.find('\n') + 1;
+            if (elements == 0 || n == 0 || n > MAX_VECTOR_LEN || payload.size() - elements != n * sizeof(double)) {
+                return false;
+            }
+            std::shared_ptr<std::vector<double> > vector = std::make_shared<std::vector<double> >(n);
+            memcpy(vector->data(), payload.data() + elements, n * sizeof(double));
+            value.vector = vector;
+        } else {
+            return false;
+        }
+    }
+
+    uint32_t variable = intern_name(name);
+    if (variable == NO_VARIABLE) {
+        return false;
+    }
+
+    session_list[session_id].in_use = true;
+    if (*in_snapshot) {
+        store_variable(session_id, variable, defined, value);
+        return true;
+    }
+
+    std::string response;
+    if (undo) {
+        apply_undo(session_id, seq, variable, defined, value);
+    } else {
+        install_variable(session_id, seq, variable, defined, value);
+    }
+    replication_lsn = lsn;
+    session_to_str(session_id, VECTOR_PREVIEW_LEN, response);
+    io.push_back(session_io_t());
+    prepare_session_io(session_id, response, io.back());
+    return true;
+}
+
+/**
+ * Follows the primary: connects to its replication port, receives a snapshot, and applies the
+ * changes streamed after it. A lost connection or a gap in the stream starts over with a new
+ * snapshot. Once SIGUSR1 arrives the replica stops following and starts accepting writes.
+ */
+void * replication_client(void * arg) {
+    struct sockaddr_in primary_address;
+    primary_address.sin_family = AF_INET;
+    primary_address.sin_addr.s_addr = inet_addr(primary_host);
+    primary_address.sin_port = htons(primary_port);
+
+    while (!promotion_requested) {
+        int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (socket_fd < 0 || connect(socket_fd, (struct sockaddr *) &primary_address, sizeof(primary_address)) < 0
+            || send_message(socket_fd, "REPLICA") < 0) {
+            if (socket_fd >= 0) {
+                close(socket_fd);
+            }
+            usleep(REPLICA_RETRY_MS * 1000);
+            continue;
+        }
+
+        primary_socket_fd = socket_fd;
+        printf("Following the primary at %s:%d.\n", primary_host, primary_port);
+
+        char buffer[REPLICA_READ_LEN];
+        bool in_snapshot = false;
+        bool in_order = true;
+        frame_decoder_reset(&primary_decoder);
+
+        while (in_order && !promotion_requested) {
+            ssize_t len = recv(socket_fd, buffer, sizeof(buffer), 0);
+            if (len <= 0) {
+                break;
+            }
+            frame_decoder_feed(&primary_decoder, buffer, len);
+
+            std::string payload;
+            int status = 0;
+            while (in_order && (status = frame_decoder_next(&primary_decoder, payload)) == 1) {
+                std::vector<session_io_t> io;
+                pthread_mutex_lock(&session_list_mutex);
+                in_order = apply_change(payload, &in_snapshot, io);
+                pthread_mutex_unlock(&session_list_mutex);
+
+                for (size_t i = 0; i < io.size(); i++) {
+                    finish_session_io(io[i]);
+                }
+            }
+            in_order = in_order && status == 0;
+        }
+
+        primary_socket_fd = -1;
+        close(socket_fd);
+        if (!promotion_requested) {
+            printf(in_order ? "Lost the primary; reconnecting.\n" : "Replication stream out of order; resynchronizing.\n");
+            usleep(REPLICA_RETRY_MS * 1000);
+        }
+    }
+
+    pthread_mutex_lock(&session_list_mutex);
+    is_replica = false;
+    printf("Promoted to primary at LSN %lld.\n", replication_lsn);
+    pthread_mutex_unlock(&session_list_mutex);
+
+    return arg;
+}
+
+/**
+ * Promotes a replica to a primary on SIGUSR1. Shutting the connection down wakes the
+ * replication thread, which finishes the promotion.
+ */
+void handle_promotion(int) {
+    promotion_requested = 1;
+
+    int socket_fd = primary_socket_fd;
+    if (socket_fd >= 0) {
+        shutdown(socket_fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * Returns the time of a monotonic clock in microseconds.
+ *
+ * @return the current time
+ */
+long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Starts recording a trace of every connection to the given file. The trace is a text file
+ * with one "<microseconds> <connection> <event> <payload>" line per event:
+ * CONNECT carries the registration message, ASSIGN the sessions the server assigned for it
+ * or for a "SUB", CMD a command, and DISCONNECT marks the end of a connection. When the server
+ * is stopped, a STATE line with connection -1 records the final state of every session.
+ * Newlines and backslashes in payloads are escaped as "\n" and "\\".
+ *
+ * @param path the path of the trace file; an existing file is overwritten
+ */
+void open_trace(const char path[]) {
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL) {
+        perror("Trace creation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(trace_file, "%s\n", TRACE_HEADER);
+    trace_start_us = now_us();
+}
+
+/**
+ * Appends an event of a connection to the trace, if one is being recorded.
+ * The lines are buffered; the file is flushed when the recording ends.
+ *
+ * @param connection_id the connection's number in the trace
+ * @param event the event name
+ * @param payload the payload of the event
+ */
+void trace_event(int connection_id, const char event[], const char payload[]) {
+    if (trace_file == NULL) {
+        return;
+    }
+
+    std::string line = std::to_string(now_us() - trace_start_us) + " " + std::to_string(connection_id) + " " + event;
+    if (payload[0] != '\0') {
+        line += ' ';
+    }
+    for (const char *c = payload; *c != '\0'; c++) {
+        if (*c == '\n') {
+            line += "\\n";
+        } else if (*c == '\\') {
+            line += "\\\\";
+        } else {
+            line += *c;
+        }
     }
-    symbol = token[0];
+    line += '\n';
 
-	if (symbol != '*' && symbol != '+' && symbol != '-' && symbol != '/') {
-		return false;
-	}
+    pthread_mutex_lock(&trace_mutex);
+    fwrite(line.data(), 1, line.size(), trace_file);
+    pthread_mutex_unlock(&trace_mutex);
+}
 
-    // Processes the second variable/value.
-    token = strtok(NULL, " ");
-	if (!token) {
-		return false;
-	}
-    if (is_str_numeric(token)) {
-        second_value = strtod(token, NULL);
-	if (second_value == '0' && symbol == '/') {
-		return false;
-	}
-    } else {
-        int second_idx = token[0] - 'a';
-	if(second_idx < 0 || second_idx > 25 || !session_list[session_id].variables[second_idx]) {
-		return false;
-	}
-        second_value = session_list[session_id].values[second_idx];
+/**
+ * Waits for SIGINT or SIGTERM, then writes the final state of every session to the trace,
+ * closes it, and exits. The session lock is kept, so nothing changes after the states are taken,
+ * and so is the disk lock, so no session or history file is cut off halfway through a write.
+ * The other threads are still running, so the server leaves with _exit(): exit() would run the
+ * destructors of the session list and the other globals under them.
+ */
+void * trace_finisher(void * arg) {
+    int signal_number;
+    sigwait(&trace_signals, &signal_number);
+
+    pthread_mutex_lock(&disk_mutex);
+    pthread_mutex_lock(&session_list_mutex);
+    std::unordered_map<int, session_t>::iterator it;
+    for (it = session_list.begin(); it != session_list.end(); ++it) {
+        if (it->second.in_use) {
+            std::string state;
+            session_to_str(it->first, VECTOR_PREVIEW_LEN, state);
+            trace_event(-1, "STATE", (std::to_string(it->first) + "\n" + state).c_str());
+        }
     }
 
-    // No data should be left over thereafter.
-    token = strtok(NULL, " ");
-	if (token) {
-		return false;
-	}
+    pthread_mutex_lock(&trace_mutex);
+    fclose(trace_file);
+    printf("Saved the trace after %lld ms.\n", (now_us() - trace_start_us) / 1000);
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
 
-    session_list[session_id].variables[result_idx] = true;
+    return arg;
+}
 
-    if (symbol == '+') {
-        session_list[session_id].values[result_idx] = first_value + second_value;
-    } else if (symbol == '-') {
-        session_list[session_id].values[result_idx] = first_value - second_value;
-    } else if (symbol == '*') {
-        session_list[session_id].values[result_idx] = first_value * second_value;
-    } else if (symbol == '/') {
-        session_list[session_id].values[result_idx] = first_value / second_value;
-    }
+/**
+ * Returns the session ID to use for a requested one.
+ * If -1 is requested, a new session with a random unused ID is created. A replica refuses:
+ * only the primary knows which IDs are taken, so an ID picked here could later be given
+ * to another browser of the primary.
+ *
+ * @param session_id the requested session ID
+ * @return the session ID to use, or -1 if a replica was asked for a new session
+ */
+int resolve_session(int session_id) {
+	if (session_id != -1 || is_replica) {
+		return session_id;
+	}
 
-    return true;
+	pthread_mutex_lock(&session_list_mutex);
+	srand((int)time(0));
+	session_t session = {};
+	// Get random id
+	while (session_id == -1 || session_list.find(session_id) != session_list.end()) {
+		session_id = rand() % 10000;
+	}
+	// Create new session in session_list.
+	// Are you supposed to save the sessions created for eternity, and not mark them as unused?
+	// If not, you can check sessions used first instead of adding new ones.
+	session_list[session_id] = session;
+	session_list[session_id].in_use = true;
+	pthread_mutex_unlock(&session_list_mutex);
+
+	return session_id;
 }
 
 /**
- * Broadcasts the given message to all browsers with the same session ID.
+ * Subscribes the browser to the session so that it receives its broadcasts.
+ * Subscribing twice has no effect.
  *
+ * @param browser_id the browser ID
  * @param session_id the session ID
- * @param message the message to be broadcasted
  */
-void broadcast(int session_id, const char message[]) {
-    for (int i = 0; i < NUM_BROWSER; ++i) {
-        if (browser_list[i].in_use && browser_list[i].session_id == session_id) {
-            send_message(browser_list[i].socket_fd, message);
-        }
-    }
+void subscribe_browser(int browser_id, int session_id) {
+	pthread_mutex_lock(&browser_list_mutex);
+	std::vector<int> &sessions = browser_list[browser_id].sessions;
+	if (std::find(sessions.begin(), sessions.end(), session_id) == sessions.end()) {
+		sessions.push_back(session_id);
+		subscriber_list[session_id].push_back(browser_id);
+	}
+	pthread_mutex_unlock(&browser_list_mutex);
 }
 
 /**
- * Gets the path for the given session.
+ * Unsubscribes the browser from the session.
  *
+ * @param browser_id the browser ID
  * @param session_id the session ID
- * @param path the path to the session file associated with the given session ID
  */
-void get_session_file_path(int session_id, char path[]) {
-    sprintf(path, "%s/session%d.dat", DATA_DIR, session_id);
+void unsubscribe_browser(int browser_id, int session_id) {
+	pthread_mutex_lock(&browser_list_mutex);
+	std::vector<int> &sessions = browser_list[browser_id].sessions;
+	sessions.erase(std::remove(sessions.begin(), sessions.end(), session_id), sessions.end());
+
+	std::unordered_map<int, std::vector<int> >::iterator it = subscriber_list.find(session_id);
+	if (it != subscriber_list.end()) {
+		it->second.erase(std::remove(it->second.begin(), it->second.end(), browser_id), it->second.end());
+		if (it->second.empty()) {
+			subscriber_list.erase(it);
+		}
+	}
+	pthread_mutex_unlock(&browser_list_mutex);
 }
 
 /**
- * Loads every session from the disk one by one if it exists.
- * Use get_session_file_path() to get the file path for each session.
+ * Arms a timer that checks the browser after the given delay.
+ * Timers are never cancelled; a browser that left or was replaced
+ * is recognized by its generation when the timer fires.
+ *
+ * @param browser_id the browser ID
+ * @param generation the generation of the browser's slot
+ * @param delay_ms the delay in milliseconds
  */
-void load_all_sessions() {
-	char path[SESSION_PATH_LEN];
-	char c;
-	int variable;
-	std::ifstream session_file;
-	std::ifstream sessions_list;
-	session_t session;
+void schedule_idle_check(int browser_id, unsigned generation, long long delay_ms) {
+    long long ticks = (delay_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (ticks < 1) {
+        ticks = 1;
+    }
 
-	sessions_list.open(SESSIONS_PATH);
+    pthread_mutex_lock(&timer_wheel_mutex);
+    wheel_timer_t timer = {browser_id, generation, (int) ((ticks - 1) / WHEEL_SLOTS)};
+    timer_wheel[(wheel_cursor + ticks - 1) % WHEEL_SLOTS].push_back(timer);
+    pthread_mutex_unlock(&timer_wheel_mutex);
+}
 
-	if (!sessions_list.good()) {
-		std::ofstream create_backup;
-		create_backup.open(SESSIONS_PATH);
-		create_backup.close();
-	}
+/**
+ * Pings a browser that has been silent for half of the idle timeout,
+ * and reaps one that has been silent for the whole of it. Reaping shuts the
+ * socket down so that the browser's handler wakes up and frees the slot.
+ *
+ * @param browser_id the browser ID
+ * @param generation the generation the timer was armed for
+ */
+void check_idle_browser(int browser_id, unsigned generation) {
+    browser_t *browser = &browser_list[browser_id];
+    long long now = now_ms();
+    long long heartbeat_ms = idle_timeout_ms / 2;
+
+    pthread_mutex_lock(&browser_list_mutex);
+    if (!browser->in_use || browser->generation != generation) {
+        pthread_mutex_unlock(&browser_list_mutex);
+        return;
+    }
 
-	int id = -1;
-	int prev_id = -1;
-	char c2;
-	double val;
-	while (sessions_list.good() && !sessions_list.eof()) {
-		sessions_list >> id;
-		sessions_list.get(c2);
-		get_session_file_path(id, path);
-		session_file.open(path);
-		if (id == prev_id) {
-			break;
-		}
-		if (!session_file.good()) {
-			printf("Error acquiring Session %d information.\n", id);
-			continue;
-		}
-		prev_id = id;
-		while (!session_file.eof()) {
-                        session_file.get(c);
-			if (session_file.eof()) {
-				break;
-			}
-                        variable = c - 'a';
-                        if (variable < 0 || variable > 25) {
-                                printf("Error with Session %d file formatting.\n", id);
-				break;
-                        }
-                        for (int j = 0; j < 3; j++) {
-                                session_file.get(c);
-                        }
-                        session_file >> val;
-			if (val) {
-				session_list[id].values[variable] = val;
-				session_list[id].variables[variable] = true;
-			} else {
-				session_list[id].variables[variable] = false;
-				session_list[id].values[variable] = 0.0;
-                        }
-			variable = -1;
-			session_file.get(c);
-                }
-		session_file.close();
-	}
+    long long last_active = __atomic_load_n(&browser->last_active_ms, __ATOMIC_RELAXED);
+    long long idle = now - last_active;
+    if (idle >= idle_timeout_ms) {
+        printf("Reaping Browser #%d after %lld ms of silence.\n", browser_id, idle);
+        shutdown(browser->socket_fd, SHUT_RDWR);
+        pthread_mutex_unlock(&browser_list_mutex);
+        return;
+    }
+
+    bool ping = idle >= heartbeat_ms && browser->last_ping_ms <= last_active;
+    if (ping) {
+        browser->last_ping_ms = now;
+    }
+    pthread_mutex_unlock(&browser_list_mutex);
+
+    if (ping) {
+        send_to_browser(browser_id, "PING");
+    }
+
+    schedule_idle_check(browser_id, generation,
+                        idle >= heartbeat_ms ? idle_timeout_ms - idle : heartbeat_ms - idle);
 }
 
 /**
- * Saves the given sessions to the disk.
- * Use get_session_file_path() to get the file path for each session.
- *
- * @param session_id the session ID
+ * Advances the timer wheel once per tick and checks the browsers whose timers expired.
+ * Browser activity only updates a timestamp; the timer is re-armed lazily when it fires.
  */
-void save_session(int session_id) {
-	char path[BUFFER_LEN];
-	char result[BUFFER_LEN];
-	bool saved = false;
-	std::ofstream session_file;
-	std::ifstream sessions_list;
-	std::ofstream sessions_output;
+void * idle_reaper(void * arg) {
+    while (true) {
+        usleep(WHEEL_TICK_MS * 1000);
 
-	sessions_list.open(SESSIONS_PATH);
+        std::vector<wheel_timer_t> due;
 
-	int id = -1;
-	char c;
-	while (!sessions_list.eof()) {
-		sessions_list >> id;
-		sessions_list.get(c);
-		if (id == -1) {
-			break;
-		}
-		if (id == session_id) {
-			saved = true;
-		}
-	}
+        pthread_mutex_lock(&timer_wheel_mutex);
+        std::vector<wheel_timer_t> &slot = timer_wheel[wheel_cursor];
+        std::vector<wheel_timer_t> later;
+        for (size_t i = 0; i < slot.size(); i++) {
+            if (slot[i].rounds > 0) {
+                slot[i].rounds--;
+                later.push_back(slot[i]);
+            } else {
+                due.push_back(slot[i]);
+            }
+        }
+        slot.swap(later);
+        wheel_cursor = (wheel_cursor + 1) % WHEEL_SLOTS;
+        pthread_mutex_unlock(&timer_wheel_mutex);
 
-	sessions_list.close();
+        for (size_t i = 0; i < due.size(); i++) {
+            check_idle_browser(due[i].browser_id, due[i].generation);
+        }
+    }
 
-	if (!saved) {
-		sessions_output.open(SESSIONS_PATH);
-		sessions_output << session_id;
-		sessions_output << '\n';
-		sessions_output.close();
-	}
+    return arg;
+}
 
-	get_session_file_path(session_id, path);
-	session_file.open(path);
+/**
+ * Sets the socket options every browser connection uses. TCP keepalive lets the kernel
+ * notice peers that vanished without closing, and the send timeout keeps a browser that
+ * stopped reading from blocking broadcasts to everybody else.
+ *
+ * @param socket_fd the socket file descriptor of the browser
+ */
+void configure_browser_socket(int socket_fd) {
+    int on = 1;
+    int idle = TCP_KEEPALIVE_IDLE;
+    int interval = TCP_KEEPALIVE_INTERVAL;
+    int count = TCP_KEEPALIVE_COUNT;
+    struct timeval send_timeout = {SEND_TIMEOUT, 0};
+
+    setsockopt(socket_fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+}
 
-	session_to_str(session_id, result);
+/**
+ * Frees the browser's slot, its subscriptions, and its socket.
+ * Only the browser's own handler calls this, so every slot is freed exactly once.
+ *
+ * @param browser_id the browser ID
+ */
+void remove_browser(int browser_id) {
+    std::vector<int> sessions = browser_list[browser_id].sessions;
+    for (size_t i = 0; i < sessions.size(); i++) {
+        unsubscribe_browser(browser_id, sessions[i]);
+    }
 
-	for (int i = 0; result[i] != '\0'; i++) {
-		session_file << result[i];
-	}
+    // The socket is closed under the lock so that the reaper never shuts down a reused descriptor.
+    // Shutting it down first unblocks any broadcast still writing to it.
+    pthread_mutex_lock(&browser_list_mutex);
+    browser_list[browser_id].in_use = false;
+    shutdown(browser_list[browser_id].socket_fd, SHUT_RDWR);
+    outbound_clear(&browser_list[browser_id].outbound);
+#ifdef USE_TLS
+    tls_close(browser_list[browser_id].socket_fd);
+#endif
+    close(browser_list[browser_id].socket_fd);
+    pthread_mutex_unlock(&browser_list_mutex);
+}
 
-	session_file.close();
+/**
+ * Answers a registration the server cannot accept with "ERROR" and frees the browser.
+ *
+ * @param browser_id the browser ID
+ */
+void refuse_registration(int browser_id) {
+	send_to_browser(browser_id, "ERROR");
+	trace_event(browser_list[browser_id].connection_id, "ASSIGN", "ERROR");
+	remove_browser(browser_id);
 }
 
 /**
  * Assigns a browser ID to the new browser.
  * Determines the correct session ID for the new browser through the interaction with it.
+ * A plain "<session_id>" registers a single-session browser. "MUX <id> <id> ..." registers
+ * a multiplexed browser subscribed to every listed session; the server answers with
+ * "MUX" followed by the resolved IDs. A replica answers "ERROR" to a request for a new session.
  *
  * @param browser_socket_fd the socket file descriptor of the browser connected
- * @return the ID for the browser
+ * @return the ID for the browser, or -1 if every slot is taken, the browser left
+ *         before registering, or its registration was refused
  */
 int register_browser(int browser_socket_fd) {
-    	int browser_id;
+    	int browser_id = -1;
 
+	pthread_mutex_lock(&browser_list_mutex);
     	for (int i = 0; i < NUM_BROWSER; ++i) {
         	if (!browser_list[i].in_use) {
             	browser_id = i;
-		pthread_mutex_lock(&browser_list_mutex);
             	browser_list[browser_id].in_use = true;
             	browser_list[browser_id].socket_fd = browser_socket_fd;
-		pthread_mutex_unlock(&browser_list_mutex);
+            	browser_list[browser_id].session_id = -1;
+            	browser_list[browser_id].multiplexed = false;
+            	browser_list[browser_id].sessions.clear();
+            	browser_list[browser_id].generation++;
+            	browser_list[browser_id].last_active_ms = now_ms();
+            	browser_list[browser_id].last_ping_ms = 0;
+            	browser_list[browser_id].connection_id = next_connection_id++;
+            	outbound_attach(&browser_list[browser_id].outbound, browser_socket_fd, zerocopy_enabled);
             	break;
         	}
     	}
+	pthread_mutex_unlock(&browser_list_mutex);
+
+	if (browser_id == -1) {
+#ifdef USE_TLS
+		tls_close(browser_socket_fd);
+#endif
+		close(browser_socket_fd);
+		return -1;
+	}
+
+	// The idle timer also covers browsers that connect and never register.
+	if (idle_timeout_ms > 0) {
+		schedule_idle_check(browser_id, browser_list[browser_id].generation, idle_timeout_ms / 2);
+	}
 
 	char message[BUFFER_LEN];
-	receive_message(browser_socket_fd, message);
-
-    	int session_id = strtol(message, NULL, 10);
-    	if (session_id == -1) {
-		srand((int)time(0));
-		session_t session;
-		// Get random id
-		while (session_id == -1 || session_list.find(session_id) != session_list.end()) {
-			session_id = rand() % 10000;
+	int connection_id = browser_list[browser_id].connection_id;
+	if (receive_message(browser_socket_fd, message) <= 0) {
+		remove_browser(browser_id);
+		return -1;
+	}
+	trace_event(connection_id, "CONNECT", message);
+
+	// The reply is queued before the browser subscribes, so that it is the first frame the
+	// browser gets; a broadcast racing with the registration can only be queued after it.
+	if (strncmp(message, "MUX", 3) == 0) {
+		std::string reply = "MUX";
+		std::vector<int> session_ids;
+		char *rest = message + 3;
+		char *end;
+		bool refused = false;
+
+		browser_list[browser_id].multiplexed = true;
+		while (true) {
+			long requested = strtol(rest, &end, 10);
+			if (end == rest) {
+				break;
+			}
+			rest = end;
+
+			int session_id = resolve_session((int) requested);
+			if (session_id == -1) {
+				refused = true;
+				break;
+			}
+			if (browser_list[browser_id].session_id == -1) {
+				browser_list[browser_id].session_id = session_id;
+			}
+			session_ids.push_back(session_id);
+			reply += " " + std::to_string(session_id);
 		}
-		// Create new session in session_list.
-		// Are you supposed to save the sessions created for eternity, and not mark them as unused?
-		// If not, you can check sessions used first instead of adding new ones.
-		pthread_mutex_lock(&session_list_mutex);
-		session_list[session_id] = session;
-               	session_list[session_id].in_use = true;
-		pthread_mutex_unlock(&session_list_mutex);
-    	}
 
-	pthread_mutex_lock(&browser_list_mutex);
-    	browser_list[browser_id].session_id = session_id;
-	pthread_mutex_unlock(&browser_list_mutex);
+		if (refused) {
+			refuse_registration(browser_id);
+			return -1;
+		}
+
+		send_to_browser(browser_id, reply.c_str());
+		trace_event(connection_id, "ASSIGN", reply.c_str());
+		for (size_t i = 0; i < session_ids.size(); ++i) {
+			subscribe_browser(browser_id, session_ids[i]);
+		}
+		return browser_id;
+	}
+
+    	int session_id = resolve_session(strtol(message, NULL, 10));
+	if (session_id == -1) {
+		refuse_registration(browser_id);
+		return -1;
+	}
+
+	browser_list[browser_id].session_id = session_id;
 
     	sprintf(message, "%d", session_id);
-    	send_message(browser_socket_fd, message);
+    	send_to_browser(browser_id, message);
+	trace_event(connection_id, "ASSIGN", message);
+	subscribe_browser(browser_id, session_id);
 
     	return browser_id;
 }
@@ -452,64 +2781,175 @@ int register_browser(int browser_socket_fd) {
  * Handles the given browser by listening to it, processing the message received,
  * broadcasting the update to all browsers with the same session ID, and backing up
  * the session on the disk.
+ * Multiplexed browsers may prefix a command with "@<session_id> " to target one of their
+ * sessions, and may send "SUB <session_id>" or "UNSUB <session_id>" to change their
+ * subscriptions.
  *
  * @param browser_socket_fd the socket file descriptor of the browser connected
  */
 void * browser_handler(void* bs_fd) {
 	int browser_socket_fd = *((int *) bs_fd);
+	free(bs_fd);
+
+#ifdef USE_TLS
+	// The handshake runs here rather than in the accept loop, so a slow client stalls only itself.
+	if (tls_enabled && !tls_accept(browser_socket_fd)) {
+		printf("Dropped a browser whose TLS handshake failed.\n");
+		close(browser_socket_fd);
+		return NULL;
+	}
+#endif
+
     	int browser_id = register_browser(browser_socket_fd);
 
-    int socket_fd = browser_list[browser_id].socket_fd;
-    int session_id = browser_list[browser_id].session_id;
+	if (browser_id == -1) {
+		printf("Dropped a browser that could not be registered.\n");
+		return NULL;
+	}
 
-    printf("Successfully accepted Browser #%d for Session #%d.\n", browser_id, session_id);
+    int socket_fd = browser_list[browser_id].socket_fd;
+    int default_session_id = browser_list[browser_id].session_id;
+    bool multiplexed = browser_list[browser_id].multiplexed;
+    int connection_id = browser_list[browser_id].connection_id;
+
+    printf("Successfully accepted Browser #%d for Session #%d.\n", browser_id, default_session_id);
+#ifdef USE_TLS
+    if (tls_enabled) {
+        printf("Browser #%d is encrypted %s.\n", browser_id, tls_kernel_send(socket_fd) ? "by kTLS" : "in user space");
+    }
+#endif
 
     while (true) {
         char message[BUFFER_LEN];
-        char response[BUFFER_LEN];
-
-        receive_message(socket_fd, message);
-        printf("Received message from Browser #%d for Session #%d: %s\n", browser_id, session_id, message);
+        std::string response;
+
+        // The peer closed the connection, the socket failed, or the reaper shut it down.
+        if (receive_message(socket_fd, message) <= 0) {
+            trace_event(connection_id, "DISCONNECT", "");
+            remove_browser(browser_id);
+            printf("Browser #%d disconnected.\n", browser_id);
+            return NULL;
+        }
+        __atomic_store_n(&browser_list[browser_id].last_active_ms, now_ms(), __ATOMIC_RELAXED);
+        printf("Received message from Browser #%d for Session #%d: %s\n", browser_id, default_session_id, message);
 
         if ((strcmp(message, "EXIT") == 0) || (strcmp(message, "exit") == 0)) {
-            close(socket_fd);
-            pthread_mutex_lock(&browser_list_mutex);
-            browser_list[browser_id].in_use = false;
-            pthread_mutex_unlock(&browser_list_mutex);
+            trace_event(connection_id, "DISCONNECT", "");
+            remove_browser(browser_id);
             printf("Browser #%d exited.\n", browser_id);
-            return bs_fd;
+            return NULL;
+        }
+
+        if (message[0] == '\0' || strcmp(message, "PONG") == 0) {
+            continue;
         }
 
-        if (message[0] == '\0') {
+        // Keepalive pings are answered directly and never touch a session.
+        if (strcmp(message, "PING") == 0) {
+            send_to_browser(browser_id, "PONG");
             continue;
         }
 
-        bool data_valid = process_message(session_id, message);
+        int session_id = default_session_id;
+        const char *command = message;
+
+        if (multiplexed) {
+            // Picks the session out of an "@<session_id> " tag.
+            if (command[0] == '@') {
+                char *end;
+                session_id = strtol(command + 1, &end, 10);
+                command = end;
+                while (*command == ' ') {
+                    command++;
+                }
+            }
+
+            // Subscriptions never change a session, so they are traced outside the session lock.
+            if (strncmp(command, "SUB ", 4) == 0) {
+                trace_event(connection_id, "CMD", message);
+                session_id = resolve_session(strtol(command + 4, NULL, 10));
+                if (session_id == -1) {
+                    trace_event(connection_id, "ASSIGN", "-1");
+                    reply_to_browser(browser_id, session_id, "ERROR");
+                    continue;
+                }
+                subscribe_browser(browser_id, session_id);
+                trace_event(connection_id, "ASSIGN", std::to_string(session_id).c_str());
+                pthread_mutex_lock(&session_list_mutex);
+                session_to_str(session_id, VECTOR_PREVIEW_LEN, response);
+                pthread_mutex_unlock(&session_list_mutex);
+                reply_to_browser(browser_id, session_id, response.c_str());
+                continue;
+            }
+
+            if (strncmp(command, "UNSUB ", 6) == 0) {
+                trace_event(connection_id, "CMD", message);
+                session_id = strtol(command + 6, NULL, 10);
+                unsubscribe_browser(browser_id, session_id);
+                reply_to_browser(browser_id, session_id, "UNSUB");
+                continue;
+            }
+
+            std::vector<int> &sessions = browser_list[browser_id].sessions;
+            if (std::find(sessions.begin(), sessions.end(), session_id) == sessions.end()) {
+                trace_event(connection_id, "CMD", message);
+                reply_to_browser(browser_id, session_id, "ERROR");
+                continue;
+            }
+        }
+
+        bool data_valid;
+        bool mutated;
+        bool read_only = false;
+        session_io_t io;
+
+        // The session lock keeps every mutation, its history entry, its trace line and its broadcast
+        // in one order; the broadcast is only queued under it, and written with the save once it is released.
+        pthread_mutex_lock(&session_list_mutex);
+        trace_event(connection_id, "CMD", message);
+        if (is_replica && (!is_history_command(command) || strcmp(command, "UNDO") == 0)) {
+            // Replicas only answer queries; every write goes to the primary.
+            data_valid = mutated = false;
+            read_only = true;
+        } else {
+            data_valid = execute_command(session_id, command, response, &mutated);
+        }
+
+        if (data_valid && mutated) {
+            prepare_session_io(session_id, response, io);
+        }
+        pthread_mutex_unlock(&session_list_mutex);
+
+        if (data_valid && mutated) {
+            finish_session_io(io);
+        }
+
+        if (read_only) {
+            reply_to_browser(browser_id, session_id, "READ-ONLY: this server is a replica.");
+            continue;
+        }
 
         if (!data_valid) {
             // Send the error message to the browser.
-		send_message(browser_socket_fd, "ERROR");
+		reply_to_browser(browser_id, session_id, "ERROR");
             continue;
         }
 
-        session_to_str(session_id, response);
-
-        broadcast(session_id, response);
-
-        save_session(session_id);
+        // Queries are answered to the requesting browser only.
+        if (!mutated) {
+            reply_to_browser(browser_id, session_id, response.c_str());
+        }
     }
 }
 
 /**
- * Starts the server. Sets up the connection, keeps accepting new browsers,
- * and creates handlers for them.
+ * Creates a socket listening on the given port on every interface.
+ * Exits if the port cannot be used.
  *
- * @param port the port that the server is running on
+ * @param port the port
+ * @return the socket file descriptor
  */
-void start_server(int port) {
-    // Loads every session if there exists one on the disk.
-    load_all_sessions();
-
+int open_listener(int port) {
     // Creates the socket.
     int server_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket_fd == 0) {
@@ -517,6 +2957,11 @@ void start_server(int port) {
         exit(EXIT_FAILURE);
     }
 
+    // Lets a restarted server bind again while old connections linger in TIME_WAIT,
+    // so that reconnecting browsers find it right away.
+    int reuse = 1;
+    setsockopt(server_socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Binds the socket.
     struct sockaddr_in server_address;
     server_address.sin_family = AF_INET;
@@ -532,7 +2977,63 @@ void start_server(int port) {
         perror("Socket listen failed");
         exit(EXIT_FAILURE);
     }
-    printf("The server is now listening on port %d.\n", port);
+
+    return server_socket_fd;
+}
+
+/**
+ * Starts the server. Sets up the connection, keeps accepting new browsers,
+ * and creates handlers for them.
+ *
+ * @param port the port that the server is running on
+ */
+void start_server(int port) {
+    // A recording ends on SIGINT or SIGTERM. The signals are blocked before any other thread
+    // starts, so that only the finisher ever receives them.
+    if (trace_file != NULL) {
+        sigemptyset(&trace_signals);
+        sigaddset(&trace_signals, SIGINT);
+        sigaddset(&trace_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &trace_signals, NULL);
+
+        pthread_t finisher_id;
+        pthread_create(&finisher_id, NULL, &trace_finisher, NULL);
+        pthread_detach(finisher_id);
+    }
+
+    // Loads every session if there exists one on the disk.
+    load_all_sessions();
+
+    for (int i = 0; i < NUM_BROWSER; ++i) {
+        outbound_init(&browser_list[i].outbound);
+    }
+    for (int i = 0; i < NUM_REPLICAS; ++i) {
+        outbound_init(&replica_list[i].outbound);
+    }
+
+    // Starts the thread that pings and reaps idle browsers.
+    if (idle_timeout_ms > 0) {
+        pthread_t reaper_id;
+        pthread_create(&reaper_id, NULL, &idle_reaper, NULL);
+        pthread_detach(reaper_id);
+    }
+
+    // Follows the primary if this server is a replica, and serves replicas if asked to.
+    if (is_replica) {
+        signal(SIGUSR1, handle_promotion);
+        pthread_t client_id;
+        pthread_create(&client_id, NULL, &replication_client, NULL);
+        pthread_detach(client_id);
+    }
+    if (replicate_port > 0) {
+        pthread_t listener_id;
+        pthread_create(&listener_id, NULL, &replication_listener, NULL);
+        pthread_detach(listener_id);
+    }
+
+    int server_socket_fd = open_listener(port);
+    printf("The server is now listening on port %d%s.\n", port, tls_enabled ? " with TLS" : "");
+    printf("Vector operations use the %s kernels.\n", vec_kernels()->name);
 
     // Main loop to accept new browsers and creates handlers for them.
 	while (true) {
@@ -544,15 +3045,27 @@ void start_server(int port) {
         	    	continue;
         	}
 
+        	configure_browser_socket(browser_socket_fd);
+
         	// Starts the handler for the new browser.
+		// The descriptor gets its own copy so the next accept() cannot overwrite it.
+		int *handler_fd = (int *) malloc(sizeof(int));
+		*handler_fd = browser_socket_fd;
 		pthread_t thread_id;
-		pthread_create(&thread_id, NULL, &browser_handler, &browser_socket_fd);
+		if (pthread_create(&thread_id, NULL, &browser_handler, handler_fd) != 0) {
+			perror("Handler creation failed");
+			free(handler_fd);
+			close(browser_socket_fd);
+			continue;
+		}
+		pthread_detach(thread_id);
     	}
 
     // Closes the socket.
     close(server_socket_fd);
 }
 
+#ifndef SERVER_NO_MAIN
 /**
  * The main function for the server.
  *
@@ -562,15 +3075,60 @@ void start_server(int port) {
  */
 int main(int argc, char *argv[]) {
     int port = DEFAULT_PORT;
+    const char *tls_cert_path = NULL;
+    const char *tls_key_path = NULL;
 
-    if (argc == 1) {
-    } else if ((argc == 3)
-               && ((strcmp(argv[1], "--port") == 0) || (strcmp(argv[1], "-p") == 0))) {
-        port = strtol(argv[2], NULL, 10);
+    for (int i = 1; i < argc; i++) {
+        if (((strcmp(argv[i], "--port") == 0) || (strcmp(argv[i], "-p") == 0)) && (i + 1 < argc)) {
+            port = strtol(argv[++i], NULL, 10);
 
-    } else {
-        puts("Invalid arguments.");
-        exit(EXIT_FAILURE);
+        } else if ((strcmp(argv[i], "--zerocopy") == 0) || (strcmp(argv[i], "-z") == 0)) {
+            zerocopy_enabled = true;
+
+        } else if ((strcmp(argv[i], "--idle-timeout") == 0) && (i + 1 < argc)) {
+            idle_timeout_ms = strtol(argv[++i], NULL, 10) * 1000;
+
+        } else if ((strcmp(argv[i], "--history") == 0) && (i + 1 < argc)) {
+            history_len = strtoul(argv[++i], NULL, 10);
+
+        } else if ((strcmp(argv[i], "--history-bytes") == 0) && (i + 1 < argc)) {
+            history_bytes = strtoul(argv[++i], NULL, 10);
+
+        } else if ((strcmp(argv[i], "--simd") == 0) && (i + 1 < argc)) {
+            const vec_kernels_t *kernels = vec_kernels_by_name(argv[++i]);
+            if (kernels == NULL) {
+                puts("Unsupported vector kernels.");
+                exit(EXIT_FAILURE);
+            }
+            vec_use_kernels(kernels);
+
+        } else if ((strcmp(argv[i], "--record") == 0) && (i + 1 < argc)) {
+            open_trace(argv[++i]);
+
+        } else if ((strcmp(argv[i], "--tls-cert") == 0) && (i + 1 < argc)) {
+            tls_cert_path = argv[++i];
+
+        } else if ((strcmp(argv[i], "--tls-key") == 0) && (i + 1 < argc)) {
+            tls_key_path = argv[++i];
+
+        } else if ((strcmp(argv[i], "--replicate-port") == 0) && (i + 1 < argc)) {
+            replicate_port = strtol(argv[++i], NULL, 10);
+
+        } else if ((strcmp(argv[i], "--replica-of") == 0) && (i + 1 < argc)) {
+            // "<host>:<port>" of the primary's replication port.
+            char *colon = strrchr(argv[++i], ':');
+            if (colon == NULL || colon - argv[i] >= (int) sizeof(primary_host)) {
+                puts("Invalid primary address.");
+                exit(EXIT_FAILURE);
+            }
+            snprintf(primary_host, colon - argv[i] + 1, "%s", argv[i]);
+            primary_port = strtol(colon + 1, NULL, 10);
+            is_replica = true;
+
+        } else {
+            puts("Invalid arguments.");
+            exit(EXIT_FAILURE);
+        }
     }
 
     if (port < 1024) {
@@ -578,7 +3136,25 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // Browsers are served over TLS when both a certificate and its key are given.
+    if ((tls_cert_path == NULL) != (tls_key_path == NULL)) {
+        puts("TLS needs both --tls-cert and --tls-key.");
+        exit(EXIT_FAILURE);
+    }
+    if (tls_cert_path != NULL) {
+#ifdef USE_TLS
+        if (!tls_server_init(tls_cert_path, tls_key_path)) {
+            exit(EXIT_FAILURE);
+        }
+        tls_enabled = true;
+#else
+        puts("This server was built without TLS; rebuild it with \"make TLS=1\".");
+        exit(EXIT_FAILURE);
+#endif
+    }
+
     start_server(port);
 
     exit(EXIT_SUCCESS);
 }
+#endif
@@ -0,0 +1,259 @@
+/*
+ ***************************************************************************
+ * Clarkson University                                                     *
+ * CS 444/544: Operating Systems, Spring 2024                              *
+ * Project: Prototyping a Web Server/Browser                               *
+ * Created by Daqing Hou, dhou@clarkson.edu                                *
+ *            Xinchao Song, xisong@clarkson.edu                            *
+ * April 10, 2022                                                          *
+ * Copyright © 2022-2024 CS 444/544 Instructor Team. All rights reserved.  *
+ * Unauthorized use is strictly prohibited.                                *
+ ***************************************************************************
+ */
+
+#include "symtab.hpp"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+#define SYMTAB_MIN_CAPACITY 16
+
+static std::unordered_map<std::string, uint32_t> name_ids;          // Maps every interned name to its ID.
+static std::deque<std::string> id_names;                            // The interned names, indexed by ID - 26.
+static pthread_mutex_t intern_mutex = PTHREAD_MUTEX_INITIALIZER;    // A mutex lock for the intern table.
+
+// Words that start the history commands, which could not be told apart from assignments to them.
+static const char *reserved_words[] = {"AT", "DIFF", "UNDO"};
+static const char letter_names[NUM_LETTER_VARIABLES][2] = {
+    "a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l", "m",
+    "n", "o", "p", "q", "r", "s", "t", "u", "v", "w", "x", "y", "z"
+};
+
+/**
+ * Determines if the given string is a valid variable name: a letter or an underscore
+ * followed by at most MAX_NAME_LEN - 1 letters, digits or underscores, other than a reserved word.
+ *
+ * @param name the string
+ * @return a boolean that determines if the string is a valid variable name
+ */
+bool is_identifier(const char name[]) {
+    if (name == NULL || !(isalpha((unsigned char) name[0]) || name[0] == '_')) {
+        return false;
+    }
+
+    int i = 1;
+    while (name[i] != '\0') {
+        if (i >= MAX_NAME_LEN || !(isalnum((unsigned char) name[i]) || name[i] == '_')) {
+            return false;
+        }
+        i++;
+    }
+
+    for (size_t j = 0; j < sizeof(reserved_words) / sizeof(reserved_words[0]); j++) {
+        if (strcmp(name, reserved_words[j]) == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Returns the ID of the given name, interning it if it is new. Single lowercase letters
+ * map straight to 0-25 without touching the intern table.
+ *
+ * @param name the variable name
+ * @return the ID, or NO_VARIABLE if the name is invalid or the intern table is full
+ */
+uint32_t intern_name(const char name[]) {
+    if (name[0] >= 'a' && name[0] <= 'z' && name[1] == '\0') {
+        return name[0] - 'a';
+    }
+    if (!is_identifier(name)) {
+        return NO_VARIABLE;
+    }
+
+    uint32_t id = NO_VARIABLE;
+    pthread_mutex_lock(&intern_mutex);
+    std::unordered_map<std::string, uint32_t>::iterator it = name_ids.find(name);
+    if (it != name_ids.end()) {
+        id = it->second;
+    } else if (id_names.size() < MAX_INTERNED_NAMES) {
+        id = NUM_LETTER_VARIABLES + id_names.size();
+        id_names.push_back(name);
+        name_ids[name] = id;
+    }
+    pthread_mutex_unlock(&intern_mutex);
+
+    return id;
+}
+
+/**
+ * Returns the ID of the given name if it was ever interned.
+ * Unlike intern_name(), reading an unknown name never grows the intern table.
+ *
+ * @param name the variable name
+ * @return the ID, or NO_VARIABLE if the name is unknown
+ */
+uint32_t lookup_name(const char name[]) {
+    if (name[0] >= 'a' && name[0] <= 'z' && name[1] == '\0') {
+        return name[0] - 'a';
+    }
+
+    uint32_t id = NO_VARIABLE;
+    pthread_mutex_lock(&intern_mutex);
+    std::unordered_map<std::string, uint32_t>::iterator it = name_ids.find(name);
+    if (it != name_ids.end()) {
+        id = it->second;
+    }
+    pthread_mutex_unlock(&intern_mutex);
+
+    return id;
+}
+
+/**
+ * Returns the name of the given variable ID.
+ * The name is stored once and stays valid for the life of the process.
+ *
+ * @param id the variable ID
+ * @return the name
+ */
+const char * variable_name(uint32_t id) {
+    if (id < NUM_LETTER_VARIABLES) {
+        return letter_names[id];
+    }
+
+    pthread_mutex_lock(&intern_mutex);
+    const char *name = id_names[id - NUM_LETTER_VARIABLES].c_str();
+    pthread_mutex_unlock(&intern_mutex);
+
+    return name;
+}
+
+/**
+ * Returns the home slot of the given ID in a table of the given capacity.
+ *
+ * @param id the variable ID
+ * @param capacity the capacity of the table, a power of two
+ * @return the index of the first slot to probe
+ */
+static uint32_t symtab_home(uint32_t id, uint32_t capacity) {
+    return (id * 2654435769u) & (capacity - 1);
+}
+
+/**
+ * Creates an empty symbol table.
+ *
+ * @return the new table
+ */
+symtab_t * symtab_create() {
+    symtab_t *table = (symtab_t *) malloc(sizeof(symtab_t));
+    table->capacity = SYMTAB_MIN_CAPACITY;
+    table->size = 0;
+    table->slots = (symbol_slot_t *) malloc(table->capacity * sizeof(symbol_slot_t));
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        table->slots[i].id = NO_VARIABLE;
+    }
+    return table;
+}
+
+/**
+ * Frees the symbol table.
+ *
+ * @param table the table
+ */
+void symtab_free(symtab_t * table) {
+    if (table != NULL) {
+        free(table->slots);
+        free(table);
+    }
+}
+
+/**
+ * Finds the slot of the given variable.
+ *
+ * @param table the table
+ * @param id the variable ID
+ * @return the slot, or NULL if the variable has none
+ */
+symbol_slot_t * symtab_find(const symtab_t * table, uint32_t id) {
+    uint32_t mask = table->capacity - 1;
+
+    for (uint32_t i = symtab_home(id, table->capacity);; i = (i + 1) & mask) {
+        if (table->slots[i].id == id) {
+            return &table->slots[i];
+        }
+        if (table->slots[i].id == NO_VARIABLE) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Doubles the capacity of the table and re-inserts every slot.
+ *
+ * @param table the table
+ */
+static void symtab_grow(symtab_t * table) {
+    symbol_slot_t *old_slots = table->slots;
+    uint32_t old_capacity = table->capacity;
+
+    table->capacity *= 2;
+    table->slots = (symbol_slot_t *) malloc(table->capacity * sizeof(symbol_slot_t));
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        table->slots[i].id = NO_VARIABLE;
+    }
+
+    uint32_t mask = table->capacity - 1;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i].id == NO_VARIABLE) {
+            continue;
+        }
+
+        uint32_t j = symtab_home(old_slots[i].id, table->capacity);
+        while (table->slots[j].id != NO_VARIABLE) {
+            j = (j + 1) & mask;
+        }
+        table->slots[j] = old_slots[i];
+    }
+
+    free(old_slots);
+}
+
+/**
+ * Finds the slot of the given variable, creating an unset one if it has none.
+ * The table grows before it gets more than 3/4 full, which keeps probe sequences short.
+ *
+ * @param table the table
+ * @param id the variable ID
+ * @return the slot
+ */
+symbol_slot_t * symtab_insert(symtab_t * table, uint32_t id) {
+    symbol_slot_t *slot = symtab_find(table, id);
+    if (slot != NULL) {
+        return slot;
+    }
+
+    if ((table->size + 1) * 4 > table->capacity * 3) {
+        symtab_grow(table);
+    }
+
+    uint32_t mask = table->capacity - 1;
+    uint32_t i = symtab_home(id, table->capacity);
+    while (table->slots[i].id != NO_VARIABLE) {
+        i = (i + 1) & mask;
+    }
+
+    table->slots[i].id = id;
+    table->slots[i].defined = false;
+    table->slots[i].value = 0.0;
+    table->size++;
+
+    return &table->slots[i];
+}
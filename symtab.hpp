@@ -0,0 +1,63 @@
+/*
+ ***************************************************************************
+ * Clarkson University                                                     *
+ * CS 444/544: Operating Systems, Spring 2024                              *
+ * Project: Prototyping a Web Server/Browser                               *
+ * Created by Daqing Hou, dhou@clarkson.edu                                *
+ *            Xinchao Song, xisong@clarkson.edu                            *
+ * April 10, 2022                                                          *
+ * Copyright © 2022-2024 CS 444/544 Instructor Team. All rights reserved.  *
+ * Unauthorized use is strictly prohibited.                                *
+ ***************************************************************************
+ */
+
+#ifndef PROJECT_SYMTAB_H
+#define PROJECT_SYMTAB_H
+
+#include <stdint.h>
+
+// The single-letter variables 'a' to 'z' always have the IDs 0 to 25.
+#define NUM_LETTER_VARIABLES 26
+#define MAX_NAME_LEN 63
+#define MAX_INTERNED_NAMES (1 << 20)
+#define NO_VARIABLE UINT32_MAX
+
+// A slot of a symbol table. A variable that was unset keeps its slot with defined == false.
+typedef struct symbol_slot_struct {
+    uint32_t id;
+    bool defined;
+    double value;
+} symbol_slot_t;
+
+// A flat open-addressing hash table from variable IDs to values, probed linearly.
+typedef struct symtab_struct {
+    symbol_slot_t *slots;
+    uint32_t capacity;      // Always a power of two.
+    uint32_t size;          // Slots taken, including unset variables.
+} symtab_t;
+
+// Determines if the given string is a valid variable name.
+bool is_identifier(const char name[]);
+
+// Returns the ID of the given name, interning it if it is new.
+uint32_t intern_name(const char name[]);
+
+// Returns the ID of the given name if it was ever interned.
+uint32_t lookup_name(const char name[]);
+
+// Returns the name of the given variable ID.
+const char * variable_name(uint32_t id);
+
+// Creates an empty symbol table.
+symtab_t * symtab_create();
+
+// Frees the symbol table.
+void symtab_free(symtab_t * table);
+
+// Finds the slot of the given variable, or NULL if it has none.
+symbol_slot_t * symtab_find(const symtab_t * table, uint32_t id);
+
+// Finds the slot of the given variable, creating an unset one if it has none.
+symbol_slot_t * symtab_insert(symtab_t * table, uint32_t id);
+
+#endif //PROJECT_SYMTAB_H
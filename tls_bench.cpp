@@ -0,0 +1,375 @@
+/*
+ ***************************************************************************
+ * Clarkson University                                                     *
+ * CS 444/544: Operating Systems, Spring 2024                              *
+ * Project: Prototyping a Web Server/Browser                               *
+ * Created by Daqing Hou, dhou@clarkson.edu                                *
+ *            Xinchao Song, xisong@clarkson.edu                            *
+ * April 10, 2022                                                          *
+ * Copyright © 2022-2024 CS 444/544 Instructor Team. All rights reserved.  *
+ * Unauthorized use is strictly prohibited.                                *
+ ***************************************************************************
+ */
+
+#include "net_util.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include <string>
+
+#define HANDSHAKES 500                      // Connections opened for each handshake measurement.
+#define STREAM_BYTES (256 * 1024 * 1024)    // Payload bytes streamed for each throughput measurement.
+#define STREAM_FRAME_LEN (16 * 1024)        // Payload bytes of each streamed frame.
+#define STREAM_BATCH 64                     // Frames queued before each flush.
+
+// A listener served by its own thread, with or without TLS.
+typedef struct listener_struct {
+    int socket_fd;
+    int port;
+    bool tls;
+} listener_t;
+
+// Returns the time of a monotonic clock in nanoseconds.
+long long now_ns();
+
+// Writes a self-signed certificate for 127.0.0.1 and its key to the given files.
+bool create_certificate(const char cert_path[], const char key_path[]);
+
+// Opens a listener on an ephemeral localhost port.
+void open_bench_listener(listener_t * listener, bool tls);
+
+// Serves the connections of a listener one at a time.
+void * serve(void * arg);
+
+// Opens a connection to the given port, over TLS if asked to.
+int open_bench_connection(int port, bool tls, bool * resumed);
+
+// Closes a connection opened by open_bench_connection().
+void close_bench_connection(int socket_fd);
+
+// Measures how many TLS connections per second are set up and used for one round trip.
+double measure_handshakes(int port, bool resume, int * resumed_count);
+
+// Measures the bytes per second the server streams to one connection.
+double measure_stream(int port, bool tls, bool * kernel_send);
+
+/**
+ * Returns the time of a monotonic clock in nanoseconds.
+ *
+ * @return the current time
+ */
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Writes a self-signed P-256 certificate for 127.0.0.1 and its key,
+ * so the benchmark needs no files of its own.
+ *
+ * @param cert_path where to write the certificate
+ * @param key_path where to write the private key
+ * @return false if they could not be created
+ */
+bool create_certificate(const char cert_path[], const char key_path[]) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    if (key == NULL || cert == NULL) {
+        return false;
+    }
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "tls_bench", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+
+    X509V3_CTX ctx;
+    X509V3_set_ctx_nodb(&ctx);
+    X509V3_set_ctx(&ctx, cert, cert, NULL, NULL, 0);
+    X509_EXTENSION *ext = X509V3_EXT_conf_nid(NULL, &ctx, NID_subject_alt_name, "IP:127.0.0.1");
+    X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+
+    bool ok = X509_sign(cert, key, EVP_sha256()) > 0;
+
+    FILE *cert_file = fopen(cert_path, "w");
+    FILE *key_file = fopen(key_path, "w");
+    ok = ok && cert_file != NULL && key_file != NULL &&
+         PEM_write_X509(cert_file, cert) == 1 &&
+         PEM_write_PrivateKey(key_file, key, NULL, NULL, 0, NULL, NULL) == 1;
+    if (cert_file != NULL) {
+        fclose(cert_file);
+    }
+    if (key_file != NULL) {
+        fclose(key_file);
+    }
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+/**
+ * Opens a listener on an ephemeral localhost port.
+ *
+ * @param listener set to the listening socket and its port
+ * @param tls whether its connections use TLS
+ */
+void open_bench_listener(listener_t * listener, bool tls) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(DEFAULT_HOST_IP);
+    addr.sin_port = 0;
+
+    listener->socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener->socket_fd < 0 ||
+        bind(listener->socket_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(listener->socket_fd, 128) < 0 ||
+        getsockname(listener->socket_fd, (struct sockaddr *) &addr, &addr_len) < 0) {
+        perror("Listener setup failed");
+        exit(EXIT_FAILURE);
+    }
+    listener->port = ntohs(addr.sin_port);
+    listener->tls = tls;
+}
+
+/**
+ * Serves the connections of a listener one at a time, like a browser handler would.
+ * "HELLO" is answered with "OK". "STREAM <bytes>" is answered with that many payload
+ * bytes in shared frames, written through the same outbound queue as a broadcast.
+ *
+ * @param arg the listener
+ * @return NULL
+ */
+void * serve(void * arg) {
+    listener_t *listener = (listener_t *) arg;
+    std::string payload(STREAM_FRAME_LEN, 'x');
+    frame_t *frame = frame_create(payload.c_str(), payload.size());
+    outbound_t out;
+    outbound_init(&out);
+
+    while (true) {
+        int socket_fd = accept(listener->socket_fd, NULL, NULL);
+        if (socket_fd < 0) {
+            continue;
+        }
+        if (listener->tls && !tls_accept(socket_fd)) {
+            close(socket_fd);
+            continue;
+        }
+        outbound_attach(&out, socket_fd, true);
+
+        char message[BUFFER_LEN];
+        while (receive_message(socket_fd, message) > 0) {
+            if (strcmp(message, "HELLO") == 0) {
+                send_message(socket_fd, "OK");
+            } else if (strncmp(message, "STREAM ", 7) == 0) {
+                long long frames = strtoll(message + 7, NULL, 10) / STREAM_FRAME_LEN;
+                for (long long i = 0; i < frames; i++) {
+                    outbound_push(&out, frame);
+                    if ((i + 1) % STREAM_BATCH == 0 || i + 1 == frames) {
+                        outbound_flush(&out, socket_fd);
+                    }
+                }
+            }
+        }
+
+        outbound_clear(&out);
+        tls_close(socket_fd);
+        close(socket_fd);
+    }
+
+    return NULL;
+}
+
+/**
+ * Opens a connection to the given localhost port.
+ *
+ * @param port the port
+ * @param tls whether to run a TLS handshake
+ * @param resumed set to whether the TLS session was resumed
+ * @return the socket
+ */
+int open_bench_connection(int port, bool tls, bool * resumed) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(DEFAULT_HOST_IP);
+    addr.sin_port = htons(port);
+
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd < 0 || connect(socket_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("Connection failed");
+        exit(EXIT_FAILURE);
+    }
+
+    *resumed = false;
+    if (tls && !tls_connect(socket_fd, DEFAULT_HOST_IP, resumed)) {
+        exit(EXIT_FAILURE);
+    }
+    return socket_fd;
+}
+
+/**
+ * Closes a connection opened by open_bench_connection().
+ *
+ * @param socket_fd the socket
+ */
+void close_bench_connection(int socket_fd) {
+    tls_close(socket_fd);
+    close(socket_fd);
+}
+
+/**
+ * Measures how many TLS connections per second are set up and used for one round trip.
+ * The round trip also delivers the server's session ticket.
+ *
+ * @param port the TLS port
+ * @param resume whether to resume the cached session or always start over
+ * @param resumed_count set to how many of the connections were resumed
+ * @return the connections per second
+ */
+double measure_handshakes(int port, bool resume, int * resumed_count) {
+    char reply[BUFFER_LEN];
+    *resumed_count = 0;
+
+    long long start = now_ns();
+    for (int i = 0; i < HANDSHAKES; i++) {
+        if (!resume) {
+            tls_forget_session();
+        }
+
+        bool resumed;
+        int socket_fd = open_bench_connection(port, true, &resumed);
+        send_message(socket_fd, "HELLO");
+        if (receive_message(socket_fd, reply) <= 0) {
+            puts("The server dropped a connection.");
+            exit(EXIT_FAILURE);
+        }
+        close_bench_connection(socket_fd);
+
+        if (resumed) {
+            (*resumed_count)++;
+        }
+    }
+
+    return HANDSHAKES / ((now_ns() - start) / 1e9);
+}
+
+/**
+ * Measures the bytes per second the server streams to one connection,
+ * counting the payload only.
+ *
+ * @param port the port of the listener
+ * @param tls whether the listener uses TLS
+ * @param kernel_send set to whether kTLS encrypted the stream
+ * @return the payload bytes per second
+ */
+double measure_stream(int port, bool tls, bool * kernel_send) {
+    bool resumed;
+    int socket_fd = open_bench_connection(port, tls, &resumed);
+    *kernel_send = tls_kernel_send(socket_fd);
+
+    long long frames = STREAM_BYTES / STREAM_FRAME_LEN;
+    long long expected = frames * (STREAM_FRAME_LEN + FRAME_HEADER_LEN);
+    long long received = 0;
+    static char buffer[256 * 1024];
+
+    char request[BUFFER_LEN];
+    snprintf(request, sizeof(request), "STREAM %d", STREAM_BYTES);
+
+    long long start = now_ns();
+    send_message(socket_fd, request);
+    while (received < expected) {
+        ssize_t n = socket_receive(socket_fd, buffer, sizeof(buffer));
+        if (n <= 0) {
+            puts("The server dropped the stream.");
+            exit(EXIT_FAILURE);
+        }
+        received += n;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    close_bench_connection(socket_fd);
+    return frames * STREAM_FRAME_LEN / seconds;
+}
+
+/**
+ * Benchmarks TLS on localhost: full against resumed handshakes, and the throughput
+ * of a stream sent through the broadcast path with and without encryption.
+ * Fails if resumption does not work.
+ *
+ * @return exit code
+ */
+int main() {
+    char dir[] = "/tmp/tls_bench.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("Temporary directory creation failed");
+        exit(EXIT_FAILURE);
+    }
+    std::string cert_path = std::string(dir) + "/cert.pem";
+    std::string key_path = std::string(dir) + "/key.pem";
+
+    bool ready = create_certificate(cert_path.c_str(), key_path.c_str()) &&
+                 tls_server_init(cert_path.c_str(), key_path.c_str()) &&
+                 tls_client_init(cert_path.c_str(), NULL);
+    unlink(cert_path.c_str());
+    unlink(key_path.c_str());
+    rmdir(dir);
+    if (!ready) {
+        puts("TLS setup failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    listener_t listeners[2];
+    open_bench_listener(&listeners[0], false);
+    open_bench_listener(&listeners[1], true);
+    for (int i = 0; i < 2; i++) {
+        pthread_t thread_id;
+        pthread_create(&thread_id, NULL, &serve, &listeners[i]);
+        pthread_detach(thread_id);
+    }
+
+    int full_resumed;
+    int resumed;
+    double full_rate = measure_handshakes(listeners[1].port, false, &full_resumed);
+    double resumed_rate = measure_handshakes(listeners[1].port, true, &resumed);
+
+    printf("full handshakes:     %8.0f connections/s  (%d of %d resumed)\n", full_rate, full_resumed, HANDSHAKES);
+    printf("resumed handshakes:  %8.0f connections/s  (%d of %d resumed)  %.2fx\n", resumed_rate, resumed, HANDSHAKES,
+           resumed_rate / full_rate);
+
+    bool kernel_send;
+    double plain_rate = measure_stream(listeners[0].port, false, &kernel_send);
+    double tls_rate = measure_stream(listeners[1].port, true, &kernel_send);
+
+    printf("plaintext stream:    %8.2f GB/s  (%d MiB in %d KiB frames)\n", plain_rate / 1e9,
+           STREAM_BYTES / (1024 * 1024), STREAM_FRAME_LEN / 1024);
+    printf("TLS stream:          %8.2f GB/s  (encrypted %s)\n", tls_rate / 1e9,
+           kernel_send ? "by kTLS" : "in user space; kTLS is not available");
+
+    // Every connection after the first one should have resumed the previous session.
+    bool ok = full_resumed == 0 && resumed == HANDSHAKES;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
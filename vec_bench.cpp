@@ -0,0 +1,304 @@
+/*
+ ***************************************************************************
+ * Clarkson University                                                     *
+ * CS 444/544: Operating Systems, Spring 2024                              *
+ * Project: Prototyping a Web Server/Browser                               *
+ * Created by Daqing Hou, dhou@clarkson.edu                                *
+ *            Xinchao Song, xisong@clarkson.edu                            *
+ * April 10, 2022                                                          *
+ * Copyright © 2022-2024 CS 444/544 Instructor Team. All rights reserved.  *
+ * Unauthorized use is strictly prohibited.                                *
+ ***************************************************************************
+ */
+
+#include "vecmath.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <vector>
+
+#define ADD_LEN 10000                       // Elements in the add being measured.
+#define CHECK_LEN 10007                     // Elements in the correctness check; odd, to cover the tails.
+#define COPY_BYTES (3 * ADD_LEN * sizeof(double) / 2)  // Bytes per copy; source and destination
+                                                        // together take as much cache as an add.
+#define ROUNDS 7                            // Timed rounds; the best one counts.
+#define ROUND_NS 50000000LL                 // Nanoseconds each round runs for at least.
+#define MAX_BANDWIDTH_RATIO (4.0 / 3.0)     // How much slower than a copy of the same footprint an add may be.
+#define MIN_SIMD_SPEEDUP 1.25               // How much faster than the scalar kernels SIMD ones must add.
+
+// Returns the time of a monotonic clock in nanoseconds.
+long long now_ns();
+
+// Measures the bandwidth in bytes per second of memcpy over the same cache footprint as the add.
+double measure_bandwidth();
+
+// Measures the bytes per second the given kernels move through a 10k-element add.
+double measure_add(const vec_kernels_t * kernels);
+
+// Returns true if two results are the same value; any two NaNs are.
+bool same_value(double x, double y);
+
+// Compares every operation of the given kernels with the scalar ones over the given vectors.
+bool compare_kernels(const vec_kernels_t * kernels, const std::vector<double> & a, const std::vector<double> & b);
+
+// Checks every operation of the given kernels against the scalar ones.
+bool check_kernels(const vec_kernels_t * kernels);
+
+/**
+ * Returns the time of a monotonic clock in nanoseconds.
+ *
+ * @return the current time
+ */
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Measures the bandwidth of memcpy over the same cache footprint as the add: a source and a
+ * destination that together are as large as its three vectors. Both stay in the same cache
+ * level, so the add is held to what the cache can move rather than to main memory, which
+ * any kernel outruns. A copy reads and writes every byte, so both count.
+ *
+ * @return the best bandwidth seen, in bytes per second
+ */
+double measure_bandwidth() {
+    std::vector<char> source(COPY_BYTES, 1);
+    std::vector<char> destination(COPY_BYTES, 0);
+    // Called through a volatile pointer, so the compiler cannot drop the repeated copies.
+    void *(*volatile copy)(void *, const void *, size_t) = memcpy;
+    double best = 0.0;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        long long iterations = 0;
+        long long start = now_ns();
+        long long elapsed;
+        do {
+            for (int i = 0; i < 100; i++) {
+                copy(destination.data(), source.data(), COPY_BYTES);
+            }
+            iterations += 100;
+            elapsed = now_ns() - start;
+        } while (elapsed < ROUND_NS);
+
+        double rate = 2.0 * COPY_BYTES * iterations / (elapsed / 1e9);
+        best = rate > best ? rate : best;
+    }
+
+    return best;
+}
+
+/**
+ * Measures a 10k-element add with the given kernels. Each add reads two vectors and writes
+ * a third, so it moves three times the size of a vector.
+ *
+ * @param kernels the kernels
+ * @return the best throughput seen, in bytes per second
+ */
+double measure_add(const vec_kernels_t * kernels) {
+    std::vector<double> a(ADD_LEN);
+    std::vector<double> b(ADD_LEN);
+    std::vector<double> out(ADD_LEN);
+    double best = 0.0;
+
+    for (size_t i = 0; i < ADD_LEN; i++) {
+        a[i] = (double) i;
+        b[i] = 0.5 * i;
+    }
+
+    for (int round = 0; round < ROUNDS; round++) {
+        long long iterations = 0;
+        long long start = now_ns();
+        long long elapsed;
+        do {
+            for (int i = 0; i < 100; i++) {
+                kernels->binary[VEC_ADD](a.data(), b.data(), out.data(), ADD_LEN);
+            }
+            iterations += 100;
+            elapsed = now_ns() - start;
+        } while (elapsed < ROUND_NS);
+
+        double rate = 3.0 * sizeof(double) * ADD_LEN * iterations / (elapsed / 1e9);
+        best = rate > best ? rate : best;
+    }
+
+    return best;
+}
+
+/**
+ * Returns true if two results are the same value; any two NaNs are.
+ *
+ * @param x a result
+ * @param y another result
+ * @return true if they are the same
+ */
+bool same_value(double x, double y) {
+    return x == y || (x != x && y != y);
+}
+
+/**
+ * Compares every operation of the given kernels with the scalar ones over the given vectors,
+ * at every length up to a few vector widths and at their full length. Element-wise results
+ * must match exactly; sums and dot products may differ by rounding, since they add in another
+ * order, unless they are not finite.
+ *
+ * @param kernels the kernels
+ * @param a the first operand, at least CHECK_LEN long
+ * @param b the second operand, as long as the first
+ * @return true if every result matches
+ */
+bool compare_kernels(const vec_kernels_t * kernels, const std::vector<double> & a, const std::vector<double> & b) {
+    const vec_kernels_t *reference = vec_kernels_by_name("scalar");
+    std::vector<double> expected(CHECK_LEN);
+    std::vector<double> actual(CHECK_LEN);
+    std::vector<size_t> lengths;
+    double s = 3.25;
+
+    // Every length up to a few vector widths exercises the tails.
+    for (size_t n = 0; n <= 17; n++) {
+        lengths.push_back(n);
+    }
+    lengths.push_back(CHECK_LEN);
+
+    for (int op = 0; op < VEC_NUM_OPS; op++) {
+        for (size_t i = 0; i < lengths.size(); i++) {
+            size_t n = lengths[i];
+            reference->binary[op](a.data(), b.data(), expected.data(), n);
+            kernels->binary[op](a.data(), b.data(), actual.data(), n);
+            if (memcmp(expected.data(), actual.data(), n * sizeof(double)) != 0) {
+                return false;
+            }
+
+            reference->binary_scalar[op](a.data(), s, expected.data(), n);
+            kernels->binary_scalar[op](a.data(), s, actual.data(), n);
+            if (memcmp(expected.data(), actual.data(), n * sizeof(double)) != 0) {
+                return false;
+            }
+
+            reference->scalar_binary[op](s, a.data(), expected.data(), n);
+            kernels->scalar_binary[op](s, a.data(), actual.data(), n);
+            if (memcmp(expected.data(), actual.data(), n * sizeof(double)) != 0) {
+                return false;
+            }
+        }
+    }
+
+    // The reductions need at least one element.
+    for (size_t i = 1; i < lengths.size(); i++) {
+        size_t n = lengths[i];
+        double tolerance = 1e-9 * n * 1000.0 * 1000.0;
+        double sums[2] = {reference->sum(a.data(), n), kernels->sum(a.data(), n)};
+        double dots[2] = {reference->dot(a.data(), b.data(), n), kernels->dot(a.data(), b.data(), n)};
+        bool sums_match = isfinite(sums[0]) ? fabs(sums[0] - sums[1]) <= tolerance : same_value(sums[0], sums[1]);
+        bool dots_match = isfinite(dots[0]) ? fabs(dots[0] - dots[1]) <= tolerance : same_value(dots[0], dots[1]);
+        if (!sums_match || !dots_match
+            || !same_value(reference->min(a.data(), n), kernels->min(a.data(), n))
+            || !same_value(reference->max(a.data(), n), kernels->max(a.data(), n))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Checks every operation of the given kernels against the scalar ones, over random values
+ * and then with a NaN or an infinity placed first, in the middle of a vector, and in a tail.
+ * Values typed into a browser may be any of those.
+ *
+ * @param kernels the kernels
+ * @return true if every result matches
+ */
+bool check_kernels(const vec_kernels_t * kernels) {
+    std::vector<double> a(CHECK_LEN);
+    std::vector<double> b(CHECK_LEN);
+    const double specials[] = {NAN, -NAN, INFINITY, -INFINITY};
+    const size_t positions[] = {0, 1, 3, 6, 13, CHECK_LEN / 2, CHECK_LEN - 1};
+
+    srand(444);
+    for (size_t i = 0; i < CHECK_LEN; i++) {
+        a[i] = rand() / (double) RAND_MAX * 2000.0 - 1000.0;
+        b[i] = rand() / (double) RAND_MAX * 2000.0 - 1000.0;
+    }
+
+    if (!compare_kernels(kernels, a, b)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(specials) / sizeof(specials[0]); i++) {
+        for (size_t j = 0; j < sizeof(positions) / sizeof(positions[0]); j++) {
+            double saved = a[positions[j]];
+            a[positions[j]] = specials[i];
+            bool match = compare_kernels(kernels, a, b);
+            a[positions[j]] = saved;
+            if (!match) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * The main function for the vector benchmark. Checks every kernel set this CPU supports,
+ * then measures a 10k-element add with each. Every SIMD set must add at least
+ * MIN_SIMD_SPEEDUP times as fast as the scalar kernels, and so must the dispatched set
+ * whenever this CPU has one; the dispatched add must also come within MAX_BANDWIDTH_RATIO
+ * of a memcpy of the same footprint.
+ *
+ * @return exit code; EXIT_FAILURE if a check fails or an add is too slow
+ */
+int main() {
+    const char *names[] = {"scalar", "sse2", "avx2"};
+    bool passed = true;
+    bool has_simd = false;
+    double scalar_rate = 0.0;
+
+    double bandwidth = measure_bandwidth();
+    printf("cache bandwidth (memcpy of %zu KiB): %.2f GB/s\n", (size_t) COPY_BYTES / 1024, bandwidth / 1e9);
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const vec_kernels_t *kernels = vec_kernels_by_name(names[i]);
+        if (kernels == NULL) {
+            printf("%-6s  not supported by this CPU\n", names[i]);
+            continue;
+        }
+
+        bool correct = check_kernels(kernels);
+        double rate = measure_add(kernels);
+        bool fast_enough = true;
+        if (i == 0) {
+            scalar_rate = rate;
+        } else {
+            has_simd = true;
+            fast_enough = rate >= scalar_rate * MIN_SIMD_SPEEDUP;
+        }
+        printf("%-6s  %d-element add: %8.2f GB/s, %8.1f ns per add, %5.2fx scalar  %s\n", names[i], ADD_LEN,
+               rate / 1e9, 3.0 * sizeof(double) * ADD_LEN / rate * 1e9, rate / scalar_rate,
+               !correct ? "MISMATCH" : fast_enough ? "ok" : "TOO SLOW");
+        passed = passed && correct && fast_enough;
+    }
+
+    const vec_kernels_t *dispatched = vec_kernels();
+    double rate = measure_add(dispatched);
+    bool fast_enough = rate * MAX_BANDWIDTH_RATIO >= bandwidth;
+    printf("dispatched to %s: %.2fx cache bandwidth (needs at least %.2fx)", dispatched->name,
+           rate / bandwidth, 1.0 / MAX_BANDWIDTH_RATIO);
+    if (has_simd) {
+        // A dispatch that falls back to the scalar kernels on a SIMD CPU fails here.
+        bool beats_scalar = rate >= scalar_rate * MIN_SIMD_SPEEDUP;
+        printf(", %.2fx scalar (needs at least %.2fx)", rate / scalar_rate, MIN_SIMD_SPEEDUP);
+        fast_enough = fast_enough && beats_scalar;
+    }
+    printf("\n");
+
+    passed = passed && fast_enough;
+    puts(passed ? "PASS" : "FAIL");
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
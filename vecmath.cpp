@@ -0,0 +1,417 @@
+/*
+ ***************************************************************************
+ * Clarkson University                                                     *
+ * CS 444/544: Operating Systems, Spring 2024                              *
+ * Project: Prototyping a Web Server/Browser                               *
+ * Created by Daqing Hou, dhou@clarkson.edu                                *
+ *            Xinchao Song, xisong@clarkson.edu                            *
+ * April 10, 2022                                                          *
+ * Copyright © 2022-2024 CS 444/544 Instructor Team. All rights reserved.  *
+ * Unauthorized use is strictly prohibited.                                *
+ ***************************************************************************
+ */
+
+#include "vecmath.hpp"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VEC_X86 1
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+// Every kernel table instantiates the same three element-wise shapes and four reductions
+// for each of the four operations.
+#define KERNEL_TABLE(isa) {                                                             \
+    #isa,                                                                               \
+    {vv_##isa<VEC_ADD>, vv_##isa<VEC_SUB>, vv_##isa<VEC_MUL>, vv_##isa<VEC_DIV>},       \
+    {vs_##isa<VEC_ADD>, vs_##isa<VEC_SUB>, vs_##isa<VEC_MUL>, vs_##isa<VEC_DIV>},       \
+    {sv_##isa<VEC_ADD>, sv_##isa<VEC_SUB>, sv_##isa<VEC_MUL>, sv_##isa<VEC_DIV>},       \
+    sum_##isa, min_##isa, max_##isa, dot_##isa                                          \
+}
+
+// The kernels vec_kernels() returns. Browser threads read it concurrently, so it is only
+// accessed atomically.
+static const vec_kernels_t * selected_kernels = NULL;
+
+/**
+ * Applies one element-wise operation to two doubles.
+ */
+template <int OP>
+static inline double apply_scalar(double x, double y) {
+    switch (OP) {
+        case VEC_ADD: return x + y;
+        case VEC_SUB: return x - y;
+        case VEC_MUL: return x * y;
+        default: return x / y;
+    }
+}
+
+/*
+ * The portable kernels, used on every CPU and for the tails of the SIMD ones.
+ */
+
+template <int OP>
+static void vv_scalar(const double a[], const double b[], double out[], size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = apply_scalar<OP>(a[i], b[i]);
+    }
+}
+
+template <int OP>
+static void vs_scalar(const double a[], double s, double out[], size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = apply_scalar<OP>(a[i], s);
+    }
+}
+
+template <int OP>
+static void sv_scalar(double s, const double a[], double out[], size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = apply_scalar<OP>(s, a[i]);
+    }
+}
+
+static double sum_scalar(const double a[], size_t n) {
+    double total = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        total += a[i];
+    }
+    return total;
+}
+
+// A NaN anywhere makes the minimum or maximum the first NaN, wherever it is; once the result
+// is a NaN, no comparison with it is true, so it stays. The SIMD kernels fall back to these
+// when they see a NaN, since their min and max instructions do not propagate it.
+static double min_scalar(const double a[], size_t n) {
+    double result = a[0];
+    for (size_t i = 1; i < n; i++) {
+        result = (a[i] < result || a[i] != a[i]) ? a[i] : result;
+    }
+    return result;
+}
+
+static double max_scalar(const double a[], size_t n) {
+    double result = a[0];
+    for (size_t i = 1; i < n; i++) {
+        result = (a[i] > result || a[i] != a[i]) ? a[i] : result;
+    }
+    return result;
+}
+
+static double dot_scalar(const double a[], const double b[], size_t n) {
+    double total = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+static const vec_kernels_t scalar_kernels = KERNEL_TABLE(scalar);
+
+#ifdef VEC_X86
+
+/*
+ * The SSE2 kernels, two doubles per instruction.
+ */
+
+template <int OP>
+static inline SSE2_TARGET __m128d apply_sse2(__m128d x, __m128d y) {
+    switch (OP) {
+        case VEC_ADD: return _mm_add_pd(x, y);
+        case VEC_SUB: return _mm_sub_pd(x, y);
+        case VEC_MUL: return _mm_mul_pd(x, y);
+        default: return _mm_div_pd(x, y);
+    }
+}
+
+template <int OP>
+static SSE2_TARGET void vv_sse2(const double a[], const double b[], double out[], size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_pd(out + i, apply_sse2<OP>(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        _mm_storeu_pd(out + i + 2, apply_sse2<OP>(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    vv_scalar<OP>(a + i, b + i, out + i, n - i);
+}
+
+template <int OP>
+static SSE2_TARGET void vs_sse2(const double a[], double s, double out[], size_t n) {
+    __m128d scalar = _mm_set1_pd(s);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, apply_sse2<OP>(_mm_loadu_pd(a + i), scalar));
+    }
+    vs_scalar<OP>(a + i, s, out + i, n - i);
+}
+
+template <int OP>
+static SSE2_TARGET void sv_sse2(double s, const double a[], double out[], size_t n) {
+    __m128d scalar = _mm_set1_pd(s);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, apply_sse2<OP>(scalar, _mm_loadu_pd(a + i)));
+    }
+    sv_scalar<OP>(s, a + i, out + i, n - i);
+}
+
+static SSE2_TARGET double sum_sse2(const double a[], size_t n) {
+    __m128d first = _mm_setzero_pd();
+    __m128d second = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        first = _mm_add_pd(first, _mm_loadu_pd(a + i));
+        second = _mm_add_pd(second, _mm_loadu_pd(a + i + 2));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(first, second));
+    return lanes[0] + lanes[1] + sum_scalar(a + i, n - i);
+}
+
+static SSE2_TARGET double min_sse2(const double a[], size_t n) {
+    if (n < 2) {
+        return min_scalar(a, n);
+    }
+
+    __m128d result = _mm_loadu_pd(a);
+    __m128d unordered = _mm_cmpunord_pd(result, result);
+    size_t i = 2;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        result = _mm_min_pd(result, x);
+        unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(x, x));
+    }
+    if (_mm_movemask_pd(unordered) != 0) {
+        return min_scalar(a, n);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, result);
+    double tail = i < n ? min_scalar(a + i, n - i) : lanes[0];
+    return min_scalar(lanes, 2) < tail ? min_scalar(lanes, 2) : tail;
+}
+
+static SSE2_TARGET double max_sse2(const double a[], size_t n) {
+    if (n < 2) {
+        return max_scalar(a, n);
+    }
+
+    __m128d result = _mm_loadu_pd(a);
+    __m128d unordered = _mm_cmpunord_pd(result, result);
+    size_t i = 2;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        result = _mm_max_pd(result, x);
+        unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(x, x));
+    }
+    if (_mm_movemask_pd(unordered) != 0) {
+        return max_scalar(a, n);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, result);
+    double tail = i < n ? max_scalar(a + i, n - i) : lanes[0];
+    return max_scalar(lanes, 2) > tail ? max_scalar(lanes, 2) : tail;
+}
+
+static SSE2_TARGET double dot_sse2(const double a[], const double b[], size_t n) {
+    __m128d first = _mm_setzero_pd();
+    __m128d second = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        first = _mm_add_pd(first, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        second = _mm_add_pd(second, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(first, second));
+    return lanes[0] + lanes[1] + dot_scalar(a + i, b + i, n - i);
+}
+
+static const vec_kernels_t sse2_kernels = KERNEL_TABLE(sse2);
+
+/*
+ * The AVX2 kernels, four doubles per instruction and two instructions per iteration.
+ */
+
+template <int OP>
+static inline AVX2_TARGET __m256d apply_avx2(__m256d x, __m256d y) {
+    switch (OP) {
+        case VEC_ADD: return _mm256_add_pd(x, y);
+        case VEC_SUB: return _mm256_sub_pd(x, y);
+        case VEC_MUL: return _mm256_mul_pd(x, y);
+        default: return _mm256_div_pd(x, y);
+    }
+}
+
+template <int OP>
+static AVX2_TARGET void vv_avx2(const double a[], const double b[], double out[], size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_pd(out + i, apply_avx2<OP>(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        _mm256_storeu_pd(out + i + 4, apply_avx2<OP>(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    vv_scalar<OP>(a + i, b + i, out + i, n - i);
+}
+
+template <int OP>
+static AVX2_TARGET void vs_avx2(const double a[], double s, double out[], size_t n) {
+    __m256d scalar = _mm256_set1_pd(s);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, apply_avx2<OP>(_mm256_loadu_pd(a + i), scalar));
+    }
+    vs_scalar<OP>(a + i, s, out + i, n - i);
+}
+
+template <int OP>
+static AVX2_TARGET void sv_avx2(double s, const double a[], double out[], size_t n) {
+    __m256d scalar = _mm256_set1_pd(s);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, apply_avx2<OP>(scalar, _mm256_loadu_pd(a + i)));
+    }
+    sv_scalar<OP>(s, a + i, out + i, n - i);
+}
+
+static AVX2_TARGET double sum_avx2(const double a[], size_t n) {
+    __m256d first = _mm256_setzero_pd();
+    __m256d second = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        first = _mm256_add_pd(first, _mm256_loadu_pd(a + i));
+        second = _mm256_add_pd(second, _mm256_loadu_pd(a + i + 4));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(first, second));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + sum_scalar(a + i, n - i);
+}
+
+static AVX2_TARGET double min_avx2(const double a[], size_t n) {
+    if (n < 4) {
+        return min_scalar(a, n);
+    }
+
+    __m256d result = _mm256_loadu_pd(a);
+    __m256d unordered = _mm256_cmp_pd(result, result, _CMP_UNORD_Q);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        result = _mm256_min_pd(result, x);
+        unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+    }
+    if (_mm256_movemask_pd(unordered) != 0) {
+        return min_scalar(a, n);
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, result);
+    double best = min_scalar(lanes, 4);
+    double tail = i < n ? min_scalar(a + i, n - i) : best;
+    return best < tail ? best : tail;
+}
+
+static AVX2_TARGET double max_avx2(const double a[], size_t n) {
+    if (n < 4) {
+        return max_scalar(a, n);
+    }
+
+    __m256d result = _mm256_loadu_pd(a);
+    __m256d unordered = _mm256_cmp_pd(result, result, _CMP_UNORD_Q);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        result = _mm256_max_pd(result, x);
+        unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+    }
+    if (_mm256_movemask_pd(unordered) != 0) {
+        return max_scalar(a, n);
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, result);
+    double best = max_scalar(lanes, 4);
+    double tail = i < n ? max_scalar(a + i, n - i) : best;
+    return best > tail ? best : tail;
+}
+
+static AVX2_TARGET double dot_avx2(const double a[], const double b[], size_t n) {
+    __m256d first = _mm256_setzero_pd();
+    __m256d second = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        first = _mm256_add_pd(first, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        second = _mm256_add_pd(second, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(first, second));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + dot_scalar(a + i, b + i, n - i);
+}
+
+static const vec_kernels_t avx2_kernels = KERNEL_TABLE(avx2);
+
+#endif
+
+/**
+ * Returns the kernels for the best instruction set this CPU supports,
+ * unless vec_use_kernels() picked others. The CPU is probed on the first call;
+ * threads racing through it pick the same kernels, and never override vec_use_kernels().
+ *
+ * @return the kernels
+ */
+const vec_kernels_t * vec_kernels() {
+    const vec_kernels_t *kernels = __atomic_load_n(&selected_kernels, __ATOMIC_ACQUIRE);
+    if (kernels != NULL) {
+        return kernels;
+    }
+
+    const vec_kernels_t *best = &scalar_kernels;
+#ifdef VEC_X86
+    if (__builtin_cpu_supports("avx2")) {
+        best = &avx2_kernels;
+    } else if (__builtin_cpu_supports("sse2")) {
+        best = &sse2_kernels;
+    }
+#endif
+
+    // On failure, kernels is set to the ones another thread or vec_use_kernels() stored first.
+    if (__atomic_compare_exchange_n(&selected_kernels, &kernels, best, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return best;
+    }
+    return kernels;
+}
+
+/**
+ * Returns the kernels with the given name.
+ *
+ * @param name "scalar", "sse2" or "avx2"
+ * @return the kernels, or NULL if they are unknown or this CPU does not support them
+ */
+const vec_kernels_t * vec_kernels_by_name(const char name[]) {
+    if (strcmp(name, "scalar") == 0) {
+        return &scalar_kernels;
+    }
+#ifdef VEC_X86
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        return &sse2_kernels;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        return &avx2_kernels;
+    }
+#endif
+    return NULL;
+}
+
+/**
+ * Makes the given kernels the ones vec_kernels() returns.
+ *
+ * @param kernels the kernels to use
+ */
+void vec_use_kernels(const vec_kernels_t * kernels) {
+    __atomic_store_n(&selected_kernels, kernels, __ATOMIC_RELEASE);
+}
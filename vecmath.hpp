@@ -0,0 +1,51 @@
+/*
+ ***************************************************************************
+ * Clarkson University                                                     *
+ * CS 444/544: Operating Systems, Spring 2024                              *
+ * Project: Prototyping a Web Server/Browser                               *
+ * Created by Daqing Hou, dhou@clarkson.edu                                *
+ *            Xinchao Song, xisong@clarkson.edu                            *
+ * April 10, 2022                                                          *
+ * Copyright © 2022-2024 CS 444/544 Instructor Team. All rights reserved.  *
+ * Unauthorized use is strictly prohibited.                                *
+ ***************************************************************************
+ */
+
+#ifndef PROJECT_VECMATH_H
+#define PROJECT_VECMATH_H
+
+#include <stddef.h>
+
+// The element-wise operations, in the order the kernel tables index them.
+#define VEC_ADD 0
+#define VEC_SUB 1
+#define VEC_MUL 2
+#define VEC_DIV 3
+#define VEC_NUM_OPS 4
+
+// A set of vector kernels built for one instruction set.
+typedef struct vec_kernels_struct {
+    const char *name;
+    // out[i] = a[i] op b[i]
+    void (*binary[VEC_NUM_OPS])(const double a[], const double b[], double out[], size_t n);
+    // out[i] = a[i] op s
+    void (*binary_scalar[VEC_NUM_OPS])(const double a[], double s, double out[], size_t n);
+    // out[i] = s op a[i]
+    void (*scalar_binary[VEC_NUM_OPS])(double s, const double a[], double out[], size_t n);
+    double (*sum)(const double a[], size_t n);
+    double (*min)(const double a[], size_t n);
+    double (*max)(const double a[], size_t n);
+    double (*dot)(const double a[], const double b[], size_t n);
+} vec_kernels_t;
+
+// Returns the kernels for the best instruction set this CPU supports.
+const vec_kernels_t * vec_kernels();
+
+// Returns the kernels with the given name ("scalar", "sse2" or "avx2"),
+// or NULL if they are unknown or this CPU does not support them.
+const vec_kernels_t * vec_kernels_by_name(const char name[]);
+
+// Makes the given kernels the ones vec_kernels() returns.
+void vec_use_kernels(const vec_kernels_t * kernels);
+
+#endif //PROJECT_VECMATH_H